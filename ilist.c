@@ -0,0 +1,186 @@
+#include "ilist.h"
+
+void IList_init(IList* pList) {
+    pList->current = NULL;
+    pList->head = NULL;
+    pList->tail = NULL;
+    pList->count = 0;
+    pList->currState = LIST_OOB_START;
+}
+
+int IList_count(IList* pList) {
+    return pList->count;
+}
+
+IListLink* IList_first(IList* pList) {
+    pList->current = pList->head;
+    if (pList->current == NULL) {pList->currState = LIST_OOB_START;}
+    return pList->current;
+}
+
+IListLink* IList_last(IList* pList) {
+    pList->current = pList->tail;
+    if (pList->current == NULL) {pList->currState = LIST_OOB_END;}
+    return pList->current;
+}
+
+IListLink* IList_next(IList* pList) {
+    if (pList->current == NULL) {
+        // before the start moves to the head; beyond the end stays there
+        if (pList->currState == LIST_OOB_END) {return NULL;}
+        pList->current = pList->head;
+    }
+    else {
+        pList->current = pList->current->next;
+    }
+
+    if (pList->current == NULL) {pList->currState = LIST_OOB_END;}
+    return pList->current;
+}
+
+IListLink* IList_prev(IList* pList) {
+    if (pList->current == NULL) {
+        // beyond the end moves to the tail; before the start stays there
+        if (pList->currState == LIST_OOB_START) {return NULL;}
+        pList->current = pList->tail;
+    }
+    else {
+        pList->current = pList->current->prev;
+    }
+
+    if (pList->current == NULL) {pList->currState = LIST_OOB_START;}
+    return pList->current;
+}
+
+IListLink* IList_curr(IList* pList) {
+    return pList->current;
+}
+
+// link pLink in between prev and next, either of which may be NULL
+static void linkBetween(IList* pList, IListLink* pLink, IListLink* prev, IListLink* next) {
+    pLink->prev = prev;
+    pLink->next = next;
+
+    if (prev != NULL) {prev->next = pLink;}
+    else {pList->head = pLink;}
+
+    if (next != NULL) {next->prev = pLink;}
+    else {pList->tail = pLink;}
+
+    pList->current = pLink;
+    pList->count++;
+}
+
+void IList_insert_after(IList* pList, IListLink* pLink) {
+    if (pList->current != NULL) {
+        linkBetween(pList, pLink, pList->current, pList->current->next);
+    }
+    else if (pList->currState == LIST_OOB_START) {
+        linkBetween(pList, pLink, NULL, pList->head);
+    }
+    else {
+        linkBetween(pList, pLink, pList->tail, NULL);
+    }
+}
+
+void IList_insert_before(IList* pList, IListLink* pLink) {
+    if (pList->current != NULL) {
+        linkBetween(pList, pLink, pList->current->prev, pList->current);
+    }
+    else if (pList->currState == LIST_OOB_START) {
+        linkBetween(pList, pLink, NULL, pList->head);
+    }
+    else {
+        linkBetween(pList, pLink, pList->tail, NULL);
+    }
+}
+
+void IList_append(IList* pList, IListLink* pLink) {
+    linkBetween(pList, pLink, pList->tail, NULL);
+}
+
+void IList_prepend(IList* pList, IListLink* pLink) {
+    linkBetween(pList, pLink, NULL, pList->head);
+}
+
+// take pLink out of pList and return the link that followed it
+static IListLink* unlinkLink(IList* pList, IListLink* pLink) {
+    IListLink* next = pLink->next;
+
+    if (pLink->prev != NULL) {pLink->prev->next = next;}
+    else {pList->head = next;}
+
+    if (next != NULL) {next->prev = pLink->prev;}
+    else {pList->tail = pLink->prev;}
+
+    pLink->prev = NULL;
+    pLink->next = NULL;
+    pList->count--;
+
+    return next;
+}
+
+IListLink* IList_remove(IList* pList) {
+    // return NULL if current pointer OOB or list empty
+    IListLink* removedLink = pList->current;
+    if (removedLink == NULL) {return NULL;}
+
+    pList->current = unlinkLink(pList, removedLink);
+    if (pList->current == NULL) {pList->currState = LIST_OOB_END;}
+
+    return removedLink;
+}
+
+IListLink* IList_trim(IList* pList) {
+    IListLink* removedLink = pList->tail;
+    if (removedLink == NULL) {return NULL;}
+
+    unlinkLink(pList, removedLink);
+
+    // the new last item becomes current, as in List_trim
+    pList->current = pList->tail;
+    if (pList->current == NULL) {pList->currState = LIST_OOB_START;}
+
+    return removedLink;
+}
+
+void IList_concat(IList* pList1, IList* pList2) {
+    if (pList2->head == NULL) {return;} // if pList2 is empty, there is nothing to concatenate
+
+    if (pList1->head == NULL) {
+        pList1->head = pList2->head;
+    }
+    else {
+        // connect pList1's tail to pList2's head
+        pList1->tail->next = pList2->head;
+        pList2->head->prev = pList1->tail;
+    }
+    pList1->tail = pList2->tail;
+    pList1->count += pList2->count;
+
+    IList_init(pList2);
+}
+
+IListLink* IList_search(IList* pList, ILIST_COMPARATOR_FN pComparator, void* pComparisonArg) {
+    // start from head if current pointer is OOB start; nothing to find beyond the end
+    IListLink* currentLink = pList->current;
+    if (currentLink == NULL) {
+        if (pList->currState == LIST_OOB_END) {return NULL;}
+        currentLink = pList->head;
+    }
+
+    while (currentLink != NULL) {
+        if ((*pComparator)(currentLink, pComparisonArg)) {
+            // if match found, leave current at it
+            pList->current = currentLink;
+            return currentLink;
+        }
+        currentLink = currentLink->next;
+    }
+
+    // no match, current is beyond the end
+    pList->current = NULL;
+    pList->currState = LIST_OOB_END;
+
+    return NULL;
+}
@@ -0,0 +1,112 @@
+// Intrusive list data type
+// Works like List, but instead of storing void* items in nodes taken from a
+// fixed pool, callers embed an IListLink in their own structs and the list
+// threads those links together. Nothing is ever allocated, so an IList can
+// hold any number of items, and walking it touches only the items themselves.
+// An item can be in as many lists at once as it has links.
+
+#ifndef _ILIST_H_
+#define _ILIST_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "list.h"
+
+typedef struct IListLink_s IListLink;
+struct IListLink_s {
+    IListLink* prev;
+    IListLink* next;
+};
+
+// Same cursor model as List: when current is NULL, currState tells whether it
+// is before the start (LIST_OOB_START) or beyond the end (LIST_OOB_END).
+typedef struct IList_s IList;
+struct IList_s {
+    IListLink* current;
+    IListLink* head;
+    IListLink* tail;
+    int count;
+    int currState;
+};
+
+// Returns the struct of the given type whose member is the link at ptr.
+#define ILIST_CONTAINER_OF(ptr, type, member) \
+    ((type*) ((char*) (ptr) - offsetof(type, member)))
+
+// Initializer for an empty list
+#define ILIST_INIT {NULL, NULL, NULL, 0, LIST_OOB_START}
+
+// Makes pList an empty list.
+void IList_init(IList* pList);
+
+// Returns the number of items in pList.
+int IList_count(IList* pList);
+
+// The functions below behave like their List counterparts in list.h, taking and
+// returning links rather than items. A link must not be inserted into a list
+// while it is in another list through the same link.
+IListLink* IList_first(IList* pList);
+IListLink* IList_last(IList* pList);
+IListLink* IList_next(IList* pList);
+IListLink* IList_prev(IList* pList);
+IListLink* IList_curr(IList* pList);
+void IList_insert_after(IList* pList, IListLink* pLink);
+void IList_insert_before(IList* pList, IListLink* pLink);
+void IList_append(IList* pList, IListLink* pLink);
+void IList_prepend(IList* pList, IListLink* pLink);
+IListLink* IList_remove(IList* pList);
+IListLink* IList_trim(IList* pList);
+
+// Adds pList2 to the end of pList1. The current pointer is set to the current pointer
+// of pList1. pList2 is left empty and can be used again.
+void IList_concat(IList* pList1, IList* pList2);
+
+// Search pList from the current item like List_search, passing links to the comparator.
+typedef bool (*ILIST_COMPARATOR_FN)(IListLink* pLink, void* pComparisonArg);
+IListLink* IList_search(IList* pList, ILIST_COMPARATOR_FN pComparator, void* pComparisonArg);
+
+// Defines type-safe wrappers named prefix_first, prefix_append, ... for lists
+// of type threaded through its IListLink member, taking and returning type*.
+// For example, with
+//     struct Message { IListLink link; char text[]; };
+//     ILIST_DEFINE(MessageList, struct Message, link)
+// MessageList_trim(&list) returns the last struct Message* in list.
+#define ILIST_DEFINE(prefix, type, member)                                          \
+    static inline type* prefix##_entry(IListLink* pLink) {                          \
+        return (pLink != NULL) ? ILIST_CONTAINER_OF(pLink, type, member) : NULL;    \
+    }                                                                               \
+    static inline type* prefix##_first(IList* pList) {                              \
+        return prefix##_entry(IList_first(pList));                                  \
+    }                                                                               \
+    static inline type* prefix##_last(IList* pList) {                               \
+        return prefix##_entry(IList_last(pList));                                   \
+    }                                                                               \
+    static inline type* prefix##_next(IList* pList) {                               \
+        return prefix##_entry(IList_next(pList));                                   \
+    }                                                                               \
+    static inline type* prefix##_prev(IList* pList) {                               \
+        return prefix##_entry(IList_prev(pList));                                   \
+    }                                                                               \
+    static inline type* prefix##_curr(IList* pList) {                               \
+        return prefix##_entry(IList_curr(pList));                                   \
+    }                                                                               \
+    static inline void prefix##_insert_after(IList* pList, type* pItem) {           \
+        IList_insert_after(pList, &pItem->member);                                  \
+    }                                                                               \
+    static inline void prefix##_insert_before(IList* pList, type* pItem) {          \
+        IList_insert_before(pList, &pItem->member);                                 \
+    }                                                                               \
+    static inline void prefix##_append(IList* pList, type* pItem) {                 \
+        IList_append(pList, &pItem->member);                                        \
+    }                                                                               \
+    static inline void prefix##_prepend(IList* pList, type* pItem) {                \
+        IList_prepend(pList, &pItem->member);                                       \
+    }                                                                               \
+    static inline type* prefix##_remove(IList* pList) {                             \
+        return prefix##_entry(IList_remove(pList));                                 \
+    }                                                                               \
+    static inline type* prefix##_trim(IList* pList) {                               \
+        return prefix##_entry(IList_trim(pList));                                   \
+    }
+
+#endif
@@ -1,5 +1,16 @@
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "list.h"
 
+// Links may be followed by lock-free readers of read-mostly lists, so a node is
+// linked in with a release store only once it is fully built, and iterators follow
+// links with acquire loads. Both compile to plain moves on x86.
+#define PUBLISH(link, node) __atomic_store_n(&(link), (node), __ATOMIC_RELEASE)
+#define FOLLOW(link) __atomic_load_n(&(link), __ATOMIC_ACQUIRE)
+
 // static arrays to store all heads and nodes
 static Node nodes[LIST_MAX_NUM_NODES];
 static List lists[LIST_MAX_NUM_HEADS];
@@ -32,6 +43,75 @@ void initialize() {
     initialized = 1;
 }
 
+// Epoch-based reclamation for read-mostly lists
+// A reader in a critical section publishes the global epoch it saw in its slot (0
+// while outside one). The writer tags each node it removes with the current epoch and
+// moves the epoch on only once every reader in a critical section has seen it, so by
+// the time the epoch is two past a node's tag no reader can still be on the node.
+static atomic_ulong globalEpoch = 1;
+static atomic_ulong readerEpochs[LIST_MAX_NUM_READERS];
+static atomic_int readerSlotsUsed[LIST_MAX_NUM_READERS];
+static atomic_int numReaderSlots = 0;  // slots ever used, bounds the writer's scans
+
+// each reader thread's slot, released by readerKey's destructor when it exits
+static __thread int readerSlot = -1;
+static __thread int readDepth = 0;
+static pthread_once_t readerKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t readerKey;
+
+// removed nodes waiting to go back to the pool, oldest first; only the writer
+// touches them
+static Node* retiredHead = NULL;
+static Node* retiredTail = NULL;
+
+// moves the epoch on if every reader in a critical section has seen it.
+// Returns true if it moved.
+static bool tryAdvanceEpoch() {
+    unsigned long epoch = atomic_load(&globalEpoch);
+
+    // pairs with the fence in List_read_lock: either the scan sees a reader that
+    // just entered, or that reader sees every node unlinked before the scan
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int numSlots = atomic_load(&numReaderSlots);
+    for (int i = 0; i < numSlots; i++) {
+        unsigned long seen = atomic_load(&readerEpochs[i]);
+        if (seen != 0 && seen != epoch) {return false;}
+    }
+    atomic_store(&globalEpoch, epoch + 1);
+    return true;
+}
+
+// put retired nodes that no reader can be on back in the pool
+static void reclaimNodes() {
+    if (retiredHead == NULL) {return;}
+
+    // with no reader in the way, moving on twice frees everything retired so far
+    if (tryAdvanceEpoch()) {tryAdvanceEpoch();}
+
+    unsigned long epoch = atomic_load(&globalEpoch);
+    while (retiredHead != NULL && retiredHead->retiredEpoch + 2 <= epoch) {
+        Node* node = retiredHead;
+        retiredHead = node->retiredNext;
+
+        node->next = freeNodes;
+        freeNodes = node;
+    }
+    if (retiredHead == NULL) {retiredTail = NULL;}
+}
+
+// queue a node just unlinked from a read-mostly list for reclamation
+static void retireNode(Node* node) {
+    node->retiredEpoch = atomic_load(&globalEpoch);
+    node->retiredNext = NULL;
+
+    if (retiredTail != NULL) {retiredTail->retiredNext = node;}
+    else {retiredHead = node;}
+    retiredTail = node;
+
+    reclaimNodes();
+}
+
 List* List_create() {
     initialize();
 
@@ -47,7 +127,14 @@ List* List_create() {
     newList->tail = NULL; 
     newList->count = 0;
     newList->currState = LIST_OOB_START;
+    newList->readMostly = false;
+
+    return newList;
+}
 
+List* List_create_read_mostly() {
+    List* newList = List_create();
+    if (newList != NULL) {newList->readMostly = true;}
     return newList;
 }
 
@@ -120,6 +207,7 @@ void* List_curr(List* pList) {
 }
 
 int List_insert_after(List* pList, void* pItem) {
+    if (freeNodes == NULL) {reclaimNodes();}
     if (freeNodes == NULL) {return LIST_FAIL;} // no free node
 
     // get a free node from the pool of nodes and initialize it
@@ -132,27 +220,27 @@ int List_insert_after(List* pList, void* pItem) {
 
     if (pList->head == NULL) {
         // if  list is empty, set this node as both head and tail
-        pList->head = newNode;
-        pList->tail = newNode;
+        PUBLISH(pList->head, newNode);
+        PUBLISH(pList->tail, newNode);
     } 
     else if (pList->current == NULL && pList->currState == LIST_OOB_START) {
         newNode->next = pList->head;
-        pList->head->prev = newNode;
-        pList->head = newNode;
+        PUBLISH(pList->head->prev, newNode);
+        PUBLISH(pList->head, newNode);
     } 
     else if ((pList->count == 1) || 
     (pList->current == pList->tail) ||
     (pList->current == NULL && pList->currState == LIST_OOB_END)) {
-        pList->tail->next = newNode;
         newNode->prev = pList->tail;
-        pList->tail = newNode;
+        PUBLISH(pList->tail->next, newNode);
+        PUBLISH(pList->tail, newNode);
     }
     else {
         // insert the new node after the current item
         newNode->next = pList->current->next;
         newNode->prev = pList->current;
-        pList->current->next->prev = newNode;
-        pList->current->next = newNode;
+        PUBLISH(pList->current->next->prev, newNode);
+        PUBLISH(pList->current->next, newNode);
     }
     pList->current = newNode;
     pList->count++;
@@ -161,6 +249,7 @@ int List_insert_after(List* pList, void* pItem) {
 }
 
 int List_insert_before(List* pList, void* pItem) {
+    if (freeNodes == NULL) {reclaimNodes();}
     if (freeNodes == NULL) {return LIST_FAIL;} // no free node
 
     // get a free node from the pool of nodes and initialize it
@@ -173,27 +262,27 @@ int List_insert_before(List* pList, void* pItem) {
 
     if (pList->head == NULL) {
         // if  list is empty, set this node as both head and tail
-        pList->head = newNode;
-        pList->tail = newNode;
+        PUBLISH(pList->head, newNode);
+        PUBLISH(pList->tail, newNode);
     } 
     else if ((pList->count == 1) || 
     (pList->current == pList->head) ||
     (pList->current == NULL && pList->currState == LIST_OOB_START)) {
         newNode->next = pList->head;
-        pList->head->prev = newNode;
-        pList->head = newNode;
+        PUBLISH(pList->head->prev, newNode);
+        PUBLISH(pList->head, newNode);
     } 
     else if (pList->current == NULL && pList->currState == LIST_OOB_END) {
-        pList->tail->next = newNode;
         newNode->prev = pList->tail;
-        pList->tail = newNode;
+        PUBLISH(pList->tail->next, newNode);
+        PUBLISH(pList->tail, newNode);
     }
     else {
         // insert the new node before the current item
         newNode->prev = pList->current->prev;
         newNode->next = pList->current;
-        pList->current->prev->next = newNode;
-        pList->current->prev = newNode;
+        PUBLISH(pList->current->prev->next, newNode);
+        PUBLISH(pList->current->prev, newNode);
     }
     pList->current = newNode;
     pList->count++;
@@ -202,6 +291,7 @@ int List_insert_before(List* pList, void* pItem) {
 }
 
 int List_append(List* pList, void* pItem) {
+    if (freeNodes == NULL) {reclaimNodes();}
     if (freeNodes == NULL) {return LIST_FAIL;} // no free node
 
     // get a free node from the pool of nodes and initialize it
@@ -214,14 +304,14 @@ int List_append(List* pList, void* pItem) {
 
     if (pList->head == NULL) {
         // if  list is empty, set this node as both head and tail
-        pList->head = newNode;
-        pList->tail = newNode;
+        PUBLISH(pList->head, newNode);
+        PUBLISH(pList->tail, newNode);
     } 
     else {
         // add the new node at the end of the list
-        pList->tail->next = newNode;
         newNode->prev = pList->tail;
-        pList->tail = newNode;
+        PUBLISH(pList->tail->next, newNode);
+        PUBLISH(pList->tail, newNode);
     }
     pList->current = newNode;
     pList->count++;
@@ -230,6 +320,7 @@ int List_append(List* pList, void* pItem) {
 }
 
 int List_prepend(List* pList, void* pItem) {
+    if (freeNodes == NULL) {reclaimNodes();}
     if (freeNodes == NULL) {return LIST_FAIL;} // no free node
 
     // get a free node from the pool of nodes and initialize it
@@ -242,14 +333,14 @@ int List_prepend(List* pList, void* pItem) {
 
     if (pList->head == NULL) {
         // if  list is empty, set this node as both head and tail
-        pList->head = newNode;
-        pList->tail = newNode;
+        PUBLISH(pList->head, newNode);
+        PUBLISH(pList->tail, newNode);
     } 
     else {
         // add the new node at the start of the list
         newNode->next = pList->head;
-        pList->head->prev = newNode;
-        pList->head = newNode;
+        PUBLISH(pList->head->prev, newNode);
+        PUBLISH(pList->head, newNode);
     }
     pList->current = newNode;
     pList->count++;
@@ -266,39 +357,45 @@ void* List_remove(List* pList) {
 
     if (pList->count == 1) {
         // one item in the list
-        pList->head = NULL;
+        PUBLISH(pList->head, NULL);
         pList->current = NULL;
-        pList->tail = NULL;
+        PUBLISH(pList->tail, NULL);
         pList->currState = LIST_OOB_END;
     } 
     else if (removedNode == pList->head) {
         // current item is head
-        pList->head = removedNode->next;
+        PUBLISH(pList->head, removedNode->next);
         pList->current = pList->head;
-        pList->head->prev = NULL;
+        PUBLISH(pList->head->prev, NULL);
     } 
     else if (removedNode == pList->tail) {
         // current item is tail
-        pList->tail = removedNode->prev;
+        PUBLISH(pList->tail, removedNode->prev);
         pList->current = NULL;
-        pList->tail->next = NULL;
+        PUBLISH(pList->tail->next, NULL);
         pList->currState = LIST_OOB_END;
     } 
     else {
         // current item anywhere else
         if (removedNode->prev != NULL) {
-            removedNode->prev->next = removedNode->next;
+            PUBLISH(removedNode->prev->next, removedNode->next);
         }
         if (removedNode->next != NULL) {
-            removedNode->next->prev = removedNode->prev;
+            PUBLISH(removedNode->next->prev, removedNode->prev);
         }
         pList->current = removedNode->next;
     }
     pList->count--;
 
-    // add removed node back to the pool of free nodes
-    removedNode->next = freeNodes;
-    freeNodes = removedNode;
+    if (pList->readMostly) {
+        // readers may still be on the node; it keeps its links until they leave
+        retireNode(removedNode);
+    }
+    else {
+        // add removed node back to the pool of free nodes
+        removedNode->next = freeNodes;
+        freeNodes = removedNode;
+    }
 
     return removedItem;
 }
@@ -323,17 +420,17 @@ void List_concat(List* pList1, List* pList2) {
 
     if (pList1->head == NULL) {
         // if pList1 is empty, set its properties to pList2's properties
-        pList1->head = pList2->head;
-        pList1->tail = pList2->tail;
+        PUBLISH(pList1->head, pList2->head);
+        PUBLISH(pList1->tail, pList2->tail);
         pList1->count = pList2->count;
     } 
     else {
         // connect pList1's tail to pList2's head
-        pList1->tail->next = pList2->head;
         if (pList2->head != NULL) {
-            pList2->head->prev = pList1->tail;
+            PUBLISH(pList2->head->prev, pList1->tail);
         }
-        pList1->tail = pList2->tail;
+        PUBLISH(pList1->tail->next, pList2->head);
+        PUBLISH(pList1->tail, pList2->tail);
         pList1->count += pList2->count;
     }
 
@@ -352,6 +449,9 @@ void List_concat(List* pList1, List* pList2) {
 }
 
 void List_free(List* pList, FREE_FN pItemFreeFn){
+    // readers of a read-mostly list may still be on its nodes and items
+    if (pList->readMostly) {List_synchronize();}
+
     Node* currentNode = pList->head;
 
     // free the items and nodes to the pool of free nodes
@@ -402,4 +502,270 @@ void* List_search(List* pList, COMPARATOR_FN pComparator, void* pComparisonArg)
     pList->currState = LIST_OOB_END;
 
     return NULL;
+}
+
+void List_sort(List* pList, ORDER_FN pOrder) {
+    if (pList->count < 2) {return;}
+
+    // merge runs of runSize nodes pairwise, doubling runSize until one merge
+    // covers the whole list; prev links are rebuilt as nodes are merged
+    Node* head = pList->head;
+    Node* tail = NULL;
+    int runSize = 1;
+
+    while (1) {
+        Node* p = head;
+        int numMerges = 0;
+        head = NULL;
+        tail = NULL;
+
+        while (p != NULL) {
+            numMerges++;
+
+            // q starts the second run, up to runSize nodes after p
+            Node* q = p;
+            int pSize = 0;
+            while (pSize < runSize && q != NULL) {
+                pSize++;
+                q = q->next;
+            }
+            int qSize = runSize;
+
+            while (pSize > 0 || (qSize > 0 && q != NULL)) {
+                Node* e;
+                // take from the first run on ties to keep the sort stable
+                if (pSize == 0) {
+                    e = q;
+                    q = q->next;
+                    qSize--;
+                }
+                else if (qSize == 0 || q == NULL || (*pOrder)(p->item, q->item) <= 0) {
+                    e = p;
+                    p = p->next;
+                    pSize--;
+                }
+                else {
+                    e = q;
+                    q = q->next;
+                    qSize--;
+                }
+
+                if (tail != NULL) {tail->next = e;}
+                else {head = e;}
+                e->prev = tail;
+                tail = e;
+            }
+            p = q;
+        }
+        tail->next = NULL;
+
+        if (numMerges <= 1) {break;}
+        runSize *= 2;
+    }
+
+    pList->head = head;
+    pList->tail = tail;
+}
+
+int List_insert_sorted(List* pList, void* pItem, ORDER_FN pOrder) {
+    // fast path: items arriving in order go at the end
+    if (pList->head == NULL || (*pOrder)(pList->tail->item, pItem) <= 0) {
+        return List_append(pList, pItem);
+    }
+
+    // start from the last insert position, or the head if current is OOB
+    Node* finger = (pList->current != NULL) ? pList->current : pList->head;
+
+    if ((*pOrder)(finger->item, pItem) <= 0) {
+        // walk forward past every item that does not go after pItem
+        while (finger->next != NULL && (*pOrder)(finger->next->item, pItem) <= 0) {
+            finger = finger->next;
+        }
+    }
+    else {
+        // walk back to the last item that does not go after pItem
+        while (finger != NULL && (*pOrder)(finger->item, pItem) > 0) {
+            finger = finger->prev;
+        }
+    }
+
+    if (finger == NULL) {return List_prepend(pList, pItem);}
+
+    pList->current = finger;
+    return List_insert_after(pList, pItem);
+}
+
+void List_merge(List* pList1, List* pList2, ORDER_FN pOrder) {
+    Node* a = pList1->head;
+    Node* b = pList2->head;
+    Node* head = NULL;
+    Node* tail = NULL;
+
+    // splice the two chains together, relinking the existing nodes
+    while (a != NULL || b != NULL) {
+        Node* e;
+        if (b == NULL || (a != NULL && (*pOrder)(a->item, b->item) <= 0)) {
+            e = a;
+            a = a->next;
+        }
+        else {
+            e = b;
+            b = b->next;
+        }
+
+        if (tail != NULL) {tail->next = e;}
+        else {head = e;}
+        e->prev = tail;
+        tail = e;
+    }
+
+    pList1->head = head;
+    pList1->tail = tail;
+    pList1->count += pList2->count;
+
+    // add pList2's head back to the pool of free heads
+    pList2->nextList = freeHeads;
+    freeHeads = pList2;
+
+    // reset pList2's properties
+    pList2->head = NULL;
+    pList2->tail = NULL;
+    pList2->current = NULL;
+    pList2->currState = LIST_OOB_START;
+    pList2->count = 0;
+}
+
+void ListIter_init(ListIter* pIter, List* pList) {
+    pIter->pList = pList;
+    pIter->current = NULL;
+    pIter->currState = LIST_OOB_START;
+}
+
+// move pIter to node, or out of bounds on the given side if node is NULL
+static void* iterMoveTo(ListIter* pIter, Node* node, int outOfBounds) {
+    pIter->current = node;
+    if (node == NULL) {
+        pIter->currState = outOfBounds;
+        return NULL;
+    }
+    return node->item;
+}
+
+void* ListIter_first(ListIter* pIter) {
+    return iterMoveTo(pIter, FOLLOW(pIter->pList->head), LIST_OOB_START);
+}
+
+void* ListIter_last(ListIter* pIter) {
+    return iterMoveTo(pIter, FOLLOW(pIter->pList->tail), LIST_OOB_END);
+}
+
+void* ListIter_next(ListIter* pIter) {
+    if (pIter->current == NULL) {
+        // before the start moves to the head; beyond the end stays there
+        if (pIter->currState == LIST_OOB_END) {return NULL;}
+        return iterMoveTo(pIter, FOLLOW(pIter->pList->head), LIST_OOB_END);
+    }
+    return iterMoveTo(pIter, FOLLOW(pIter->current->next), LIST_OOB_END);
+}
+
+void* ListIter_prev(ListIter* pIter) {
+    if (pIter->current == NULL) {
+        // beyond the end moves to the tail; before the start stays there
+        if (pIter->currState == LIST_OOB_START) {return NULL;}
+        return iterMoveTo(pIter, FOLLOW(pIter->pList->tail), LIST_OOB_START);
+    }
+    return iterMoveTo(pIter, FOLLOW(pIter->current->prev), LIST_OOB_START);
+}
+
+void* ListIter_curr(ListIter* pIter) {
+    return (pIter->current != NULL) ? pIter->current->item : NULL;
+}
+
+void* ListIter_search(ListIter* pIter, COMPARATOR_FN pComparator, void* pComparisonArg) {
+    // start from head if the cursor is OOB start; nothing to find beyond the end
+    Node* currentNode = pIter->current;
+    if (currentNode == NULL) {
+        if (pIter->currState == LIST_OOB_END) {return NULL;}
+        currentNode = FOLLOW(pIter->pList->head);
+    }
+
+    while (currentNode != NULL) {
+        if ((*pComparator)(currentNode->item, pComparisonArg)) {
+            // if match found, leave the cursor at it
+            pIter->current = currentNode;
+            return currentNode->item;
+        }
+        currentNode = FOLLOW(currentNode->next);
+    }
+
+    // no match, cursor is beyond the end
+    return iterMoveTo(pIter, NULL, LIST_OOB_END);
+}
+
+// a thread that exits or is cancelled inside a critical section leaves it,
+// so its slot doesn't hold the epoch back for good
+static void releaseReaderSlot(void* slot) {
+    atomic_store_explicit(&readerEpochs[(intptr_t) slot - 1], 0, memory_order_release);
+    atomic_store(&readerSlotsUsed[(intptr_t) slot - 1], 0);
+}
+
+static void createReaderKey() {
+    pthread_key_create(&readerKey, releaseReaderSlot);
+}
+
+// give the calling thread a reader slot for as long as it runs
+static int claimReaderSlot() {
+    pthread_once(&readerKeyOnce, createReaderKey);
+
+    for (int i = 0; i < LIST_MAX_NUM_READERS; i++) {
+        int unused = 0;
+        if (!atomic_compare_exchange_strong(&readerSlotsUsed[i], &unused, 1)) {continue;}
+
+        int numSlots = atomic_load(&numReaderSlots);
+        while (numSlots <= i && !atomic_compare_exchange_weak(&numReaderSlots, &numSlots, i + 1)) {}
+
+        // the key holds slot + 1 so slot 0 isn't mistaken for no value
+        pthread_setspecific(readerKey, (void*) (intptr_t) (i + 1));
+        readerSlot = i;
+        return LIST_SUCCESS;
+    }
+    return LIST_FAIL;
+}
+
+int List_read_lock() {
+    if (readDepth > 0) {
+        readDepth++;
+        return LIST_SUCCESS;
+    }
+    if (readerSlot == -1 && claimReaderSlot() == LIST_FAIL) {return LIST_FAIL;}
+
+    // publish the epoch before following any link; see tryAdvanceEpoch
+    atomic_store_explicit(&readerEpochs[readerSlot], atomic_load(&globalEpoch), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    readDepth = 1;
+    return LIST_SUCCESS;
+}
+
+void List_read_unlock() {
+    if (--readDepth > 0) {return;}
+    atomic_store_explicit(&readerEpochs[readerSlot], 0, memory_order_release);
+}
+
+void List_synchronize() {
+    // readers entering from now on see the new epoch; wait out the ones that
+    // entered before it
+    unsigned long epoch = atomic_fetch_add(&globalEpoch, 1) + 1;
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int numSlots = atomic_load(&numReaderSlots);
+    for (int i = 0; i < numSlots; i++) {
+        unsigned long seen;
+        while ((seen = atomic_load(&readerEpochs[i])) != 0 && seen != epoch) {
+            sched_yield();
+        }
+    }
+
+    // every node retired so far is now out of readers' reach
+    reclaimNodes();
 }
\ No newline at end of file
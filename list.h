@@ -16,6 +16,8 @@ struct Node_s {
     void* item;  
     Node* prev; 
     Node* next; 
+    Node* retiredNext;            // removed from a read-mostly list, waiting for readers
+    unsigned long retiredEpoch;
 };
 
 enum ListOutOfBounds {
@@ -30,15 +32,25 @@ struct List_s{
     int count; 
     int currState;
     List* nextList;
+    bool readMostly;
 };
 
 // Maximum number of unique lists the system can support
 // (You may modify this, but reset the value to 10 when handing in your assignment)
+#ifndef LIST_MAX_NUM_HEADS
 #define LIST_MAX_NUM_HEADS 10
+#endif
 
 // Maximum total number of nodes (statically allocated) to be shared across all lists
 // (You may modify this, but reset the value to 100 when handing in your assignment)
+#ifndef LIST_MAX_NUM_NODES
 #define LIST_MAX_NUM_NODES 100
+#endif
+
+// Maximum number of threads that can read read-mostly lists at once
+#ifndef LIST_MAX_NUM_READERS
+#define LIST_MAX_NUM_READERS 64
+#endif
 
 // General Error Handling:
 // Client code is assumed never to call these functions with a NULL List pointer, or 
@@ -129,4 +141,79 @@ void List_free(List* pList, FREE_FN pItemFreeFn);
 typedef bool (*COMPARATOR_FN)(void* pItem, void* pComparisonArg);
 void* List_search(List* pList, COMPARATOR_FN pComparator, void* pComparisonArg);
 
+// Ordering: pOrder is a pointer to a routine that takes two item pointers and returns
+// a negative number if the first item goes before the second, 0 if they are equal, or a
+// positive number if the first goes after the second (like strcmp). Items that compare
+// equal keep the order they were added in.
+typedef int (*ORDER_FN)(void* pItem1, void* pItem2);
+
+// Sorts pList in place with a bottom-up merge sort that relinks the existing nodes,
+// so it takes O(n log n) time and needs no free nodes. The current item stays the same
+// item (or stays before the start or beyond the end).
+void List_sort(List* pList, ORDER_FN pOrder);
+
+// Adds item to the sorted pList after every item that does not go after it, and makes
+// the new item the current one. The search starts from the current item, so inserting
+// items that arrive nearly in order (e.g. by sequence number) takes O(1) time.
+// Returns 0 on success, -1 on failure.
+int List_insert_sorted(List* pList, void* pItem, ORDER_FN pOrder);
+
+// Merges the sorted pList2 into the sorted pList1 in O(n) time; of two equal items the one
+// from pList1 comes first. The current pointer is set to the current pointer of pList1.
+// pList2 no longer exists after the operation; its head is available for future operations.
+void List_merge(List* pList1, List* pList2, ORDER_FN pOrder);
+
+// Iterators
+// A ListIter walks a list with a cursor of its own and never touches the list's current
+// pointer, so any number of iterators can traverse the same list at once. The cursor
+// behaves like the list's: it starts before the start of the list and goes out of bounds
+// past either end. Iterators only read the list. While a thread changes an ordinary list,
+// threads iterating over it must hold the same lock as the writer (a read-write lock lets
+// them share it); a read-mostly list needs no lock, see below.
+typedef struct ListIter_s ListIter;
+struct ListIter_s {
+    List* pList;
+    Node* current;
+    int currState;
+};
+
+// Makes pIter an iterator over pList, before the start of pList.
+void ListIter_init(ListIter* pIter, List* pList);
+
+// Same as List_first, List_last, List_next, List_prev, List_curr and List_search, moving
+// pIter's cursor instead of the list's current pointer.
+void* ListIter_first(ListIter* pIter);
+void* ListIter_last(ListIter* pIter);
+void* ListIter_next(ListIter* pIter);
+void* ListIter_prev(ListIter* pIter);
+void* ListIter_curr(ListIter* pIter);
+void* ListIter_search(ListIter* pIter, COMPARATOR_FN pComparator, void* pComparisonArg);
+
+// Read-mostly lists
+// A single writer thread changes a read-mostly list with the functions above while any
+// number of reader threads walk it with ListIters, without locking. Readers wrap each
+// traversal in List_read_lock and List_read_unlock and must not use the items they found
+// after unlocking. Nodes the writer removes go back to the pool only once no reader can
+// still be on them (epoch-based reclamation), so removing never waits for readers.
+// List_sort and List_merge relink every node and must not run while readers traverse the
+// list. The writer must still be serialized with all other users of the list pools, as
+// with ordinary lists.
+
+// Makes a new, empty read-mostly list, and returns its reference on success.
+// Returns a NULL pointer on failure.
+List* List_create_read_mostly();
+
+// Enters a read-side critical section on the calling thread. Sections may nest and must
+// not span a cancellation point; a thread that exits inside one leaves it on exit.
+// Returns 0 on success, -1 if LIST_MAX_NUM_READERS other threads are readers already.
+int List_read_lock();
+
+// Leaves the critical section entered by the matching List_read_lock.
+void List_read_unlock();
+
+// Waits until every reader that was in a critical section has left it. The writer calls
+// it after removing items before freeing them, as readers may still be using them.
+// List_free does this itself for read-mostly lists. Must not be called by a reader.
+void List_synchronize();
+
 #endif
\ No newline at end of file
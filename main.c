@@ -1,302 +1,223 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
 
-#include "list.h"
+#include "pool.h"
+#include "session.h"
+#include "transport.h"
 
 #define BUFLEN 1024
 
-const char* myPort;
-const char* remoteHostname;
-const char* remotePort;
-
-List* list;
-
-// define all 4 threads
-static pthread_t inputThread;
-static pthread_t outputThread;
-static pthread_t receiverThread;
-static pthread_t senderThread;
-
-// list mutex
-static pthread_mutex_t listMutex = PTHREAD_MUTEX_INITIALIZER;
-
-// send and rec mutexes and conds
-static pthread_mutex_t sendMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t sendCond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t recMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t recCond = PTHREAD_COND_INITIALIZER;
-
-// send and rec messages and sockets to free and close, respectively 
-// when finished
-static char* messageToSend;
-static int sockfdSend;
-
-static char* messageToRec;
-static int sockfdRec;
-
-static void* keyboardInputLoop(void* args){
-    while(1){
-        char* msg;
-        char buffer[BUFLEN];
-        int size;
-        do {
-            // zero out buffer
-            bzero(buffer, BUFLEN);
-
-            // record size of message and save it in buffer
-            size = read(0, buffer, BUFLEN);
-
-            // copy buffer to malloc'd string of exact size to
-            // add to list
-            msg = (char*) malloc(sizeof(char) * (size + 1));
-            strncpy(msg, buffer, size);
-            msg[size] = '\0';
-
-            // lock list and prepend message to send
-            pthread_mutex_lock(&listMutex);
-            List_prepend(list, msg);
-            pthread_mutex_unlock(&listMutex);
-
-            // if message was a single '!', terminate chat and 
-            // cancel threads
-            if (!strcmp(msg,"!\n")){
-                pthread_mutex_lock(&sendMutex);
-                pthread_cond_signal(&sendCond);
-                pthread_mutex_unlock(&sendMutex);
-
-                pthread_cancel(outputThread);
-                pthread_cancel(receiverThread);
-                return NULL;
-            }
-        } while (buffer[size-1] != '\n'); // stop when enter pressed
-
-        // signal send thread to continue as message has been 
-        // added and list is accessible
-        pthread_mutex_lock(&sendMutex);
-        pthread_cond_signal(&sendCond);
-        pthread_mutex_unlock(&sendMutex);
+// sessions hosted on the worker pool, and how many of them are still chatting
+static Session** sessions;
+static int numSessions;
+static int liveSessions;
+static pthread_mutex_t liveMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t liveCond = PTHREAD_COND_INITIALIZER;
+
+// reads the keyboard for every session on the pool
+static pthread_t routerThread;
+
+// parse a comma-separated list of cores for the input, sender, receiver
+// and output threads into threadCpus, reusing the list from the start if
+// it is short.
+// Returns 0 on success, -1 on failure.
+static int parseCpuList(const char* cpus, int* threadCpus){
+    int parsed[SESSION_NUM_THREADS];
+    int count = 0;
+    const char* p = cpus;
+
+    while (*p != '\0' && count < SESSION_NUM_THREADS){
+        char* end;
+        long cpu = strtol(p, &end, 10);
+        if (end == p || cpu < 0 || cpu >= CPU_SETSIZE) {return -1;}
+        parsed[count++] = cpu;
+
+        if (*end == ',') {end++;}
+        else if (*end != '\0') {return -1;}
+        p = end;
     }
-    return NULL;
-}
+    if (count == 0 || *p != '\0') {return -1;}
 
-static void* sendMessageLoop(void* args) {
-    // Adapted from Beej's Guide to Network Programming
-    struct addrinfo hints, *servinfo, *p;
-
-    memset(&hints, 0 , sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    
-    int val = getaddrinfo(remoteHostname, remotePort, &hints, &servinfo);  
-    if (val != 0 ){exit(-1);}
-
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        sockfdSend = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfdSend ==-1){continue;}
-        break;
+    for (int i = 0; i < SESSION_NUM_THREADS; i++){
+        threadCpus[i] = parsed[i % count];
     }
-    if(p == NULL){exit(-1);}
-    
-    while (1) {
-        // wait until signalled by input thread to continue
-        // i.e. message is in the list and ready to send
-        pthread_mutex_lock(&sendMutex);
-        pthread_cond_wait(&sendCond, &sendMutex);
-        pthread_mutex_unlock(&sendMutex);
-
-        do {
-            // lock list and trim message to send
-            pthread_mutex_lock(&listMutex);
-            messageToSend = List_trim(list);
-            pthread_mutex_unlock(&listMutex);
-
-            // send message and assert success
-            int size = sendto(sockfdSend, messageToSend, strlen(messageToSend), 0, p->ai_addr, p->ai_addrlen);
-            if(size == -1){exit(-1);}
-
-            // if sent message was a single '!' output chat terminated and exit
-            if(!strcmp(messageToSend,"!\n")) {
-                free(messageToSend);
-                messageToSend = NULL;
+    return 0;
+}
 
-                char* endMessage = "Chat terminated\n";
-                write(1, endMessage, strlen(endMessage));
-                
-                freeaddrinfo(servinfo);
-                return NULL;
-            }
-            // free message
-            free(messageToSend);
-            messageToSend = NULL;
 
-        } while (List_count(list) != 0); // send till list empty
-    }
-    freeaddrinfo(servinfo);
-    return NULL;
+static void sessionEnded(Session* pSession, void* arg){
+    pthread_mutex_lock(&liveMutex);
+    liveSessions--;
+    pthread_cond_signal(&liveCond);
+    pthread_mutex_unlock(&liveMutex);
 }
 
-static void* receiveMessageLoop(void* args) {
-    // Adapted from Beej's Guide to Network Programming
-    struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_in remoteAddress;
-    socklen_t addressLen;
-    
-    char buffer[BUFLEN];
-    char* msg;
-    int size;
-
-    memset(&hints, 0 ,sizeof (hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = AI_PASSIVE;
-    
-    int val = getaddrinfo(NULL, myPort, &hints, &servinfo);
-    if (val != 0){exit(-1);}
+// hand each typed line to a session: "@n text" sends text to session n and
+// makes it the current one, any other line goes to the current session
+static void* routeInputLoop(void* args){
+    char line[BUFLEN];
+    int current = 0;
+    int lineStart = 1;
+
+    while (fgets(line, BUFLEN, stdin) != NULL){
+        char* text = line;
+        int len = strlen(line);
+
+        // only look for "@n" at the start of a line, not in the rest of
+        // a line longer than the buffer
+        if (lineStart && line[0] == '@'){
+            char* end;
+            long n = strtol(line + 1, &end, 10);
+            if (end != line + 1 && n >= 1 && n <= numSessions && (*end == ' ' || *end == '\n')){
+                current = n - 1;
+                text = (*end == ' ') ? end + 1 : end;
+            }
+        }
+        lineStart = (line[len - 1] == '\n');
 
-    for(p = servinfo; p != NULL; p = p->ai_next)
-    {
-        sockfdRec = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfdRec ==-1){continue;}
+        // "@n" on its own only switches sessions
+        if (text != line && !strcmp(text, "\n")) {continue;}
 
-        int bindVal = bind(sockfdRec, p->ai_addr, p->ai_addrlen);
-        if(bindVal == -1)
-        {
-            close(sockfdRec);
+        Session* pSession = sessions[current];
+        if (Session_hasEnded(pSession)){
+            char endedMessage[BUFLEN];
+            int endedLen = snprintf(endedMessage, BUFLEN, "[%d] Chat has already terminated\n", current + 1);
+            write(1, endedMessage, endedLen);
             continue;
         }
-        break;
-    }
-    if(p == NULL){exit(-1);}
-    freeaddrinfo(servinfo);
-
-    while (1){
-        do {
-            // receive message from remote address and store in buffer
-            addressLen = sizeof(remoteAddress);
-            size = recvfrom(sockfdRec, buffer, BUFLEN, 0, (struct sockaddr*) &remoteAddress, &addressLen);
-            if(size == -1){exit(-1);}
-
-            // copy buffer to malloc'd string of exact size to
-            // add to list
-            msg = (char*)malloc(sizeof(char)*(size+1));
-            strncpy(msg, buffer, size);
-            msg[size] = '\0';
-
-            // lock list and prepend message to receive
-            pthread_mutex_lock(&listMutex);
-            List_prepend(list, msg);
-            pthread_mutex_unlock(&listMutex);
-
-            // if message was a single '!', terminate chat and 
-            // cancel threads
-            if(!strcmp(msg, "!\n"))
-            {
-                pthread_mutex_lock(&recMutex);
-                pthread_cond_signal(&recCond);
-                pthread_mutex_unlock(&recMutex);
-                
-                pthread_cancel(inputThread);
-                pthread_cancel(senderThread);
-                
-                return NULL;
-            }
-        } while (buffer[size-1]!='\n'); // stop when new line found
-        
-        // signal output thread to continue as message has been 
-        // added and list is accessible
-        pthread_mutex_lock(&recMutex);
-        pthread_cond_signal(&recCond);
-        pthread_mutex_unlock(&recMutex);
+        Session_input(pSession, text, line + len - text);
     }
     return NULL;
 }
 
-static void* screenOutputLoop(void* args) {
-    while (1){
-        // wait until signalled by receiver thread to continue
-        // i.e. message is in the list and ready to output
-        pthread_mutex_lock(&recMutex);
-        pthread_cond_wait(&recCond, &recMutex);
-        pthread_mutex_unlock(&recMutex);
-
-        do {
-            // lock list and trim message to output
-            pthread_mutex_lock(&listMutex);
-            messageToRec = List_trim(list);
-            pthread_mutex_unlock(&listMutex);
+// run one session on threads of its own, as a single chat always has
+static int runSession(int transportKind, const char* const* endpoint, int lowLatency, const int* threadCpus){
+    Session* pSession = Session_open(transportKind, endpoint[0], endpoint[1], endpoint[2], "");
+    if (pSession == NULL) {
+        printf("Cannot open transport.\n");
+        return -1;
+    }
+    if (lowLatency) {Session_setLowLatency(pSession, threadCpus);}
 
-            // add prefix to differentiate local and remote
-            // messages
-            char* remotePrefix = "Remote: ";
-            write(1, remotePrefix, strlen(remotePrefix));
+    Session_run(pSession);
+    Session_close(pSession);
+    return 0;
+}
 
-            // write message and assert success
-            int writeVal = write(1, messageToRec, strlen(messageToRec));
-            if(writeVal == -1) {exit(-1);}
+// run every session on a shared pool of numWorkers workers until all of
+// their chats have terminated
+static int runPool(int transportKind, const char* const* endpoints, int count, int numWorkers){
+    sessions = (Session**) calloc(count, sizeof(Session*));
+    if (sessions == NULL) {return -1;}
+
+    // label each session's output with its number
+    for (numSessions = 0; numSessions < count; numSessions++){
+        const char* const* endpoint = endpoints + 3 * numSessions;
+        char label[SESSION_MAX_LABEL + 1];
+        snprintf(label, sizeof(label), "[%d] ", numSessions + 1);
+
+        sessions[numSessions] = Session_open(transportKind, endpoint[0], endpoint[1], endpoint[2], label);
+        if (sessions[numSessions] == NULL) {
+            printf("Cannot open transport for session %d.\n", numSessions + 1);
+            break;
+        }
+    }
 
-            // if received message is a single '!' output chat terminated and exit
-            if(!strcmp(messageToRec, "!\n")) {
-                free(messageToRec);
-                messageToRec = NULL;
+    Pool* pool = (numSessions == count) ? Pool_create(numWorkers) : NULL;
+    if (pool == NULL) {
+        if (numSessions == count) {printf("Cannot start worker pool.\n");}
+        for (int i = 0; i < numSessions; i++) {Session_close(sessions[i]);}
+        free(sessions);
+        return -1;
+    }
 
-                char* endMessage = "Chat terminated\n";
-                write(1,endMessage, strlen(endMessage));
+    // count every session live before any can end
+    int started = 1;
+    liveSessions = numSessions;
+    for (int i = 0; i < numSessions && started; i++){
+        started = (Session_start(sessions[i], pool, sessionEnded, NULL) == SESSION_SUCCESS);
+        if (!started) {printf("Cannot start session %d.\n", i + 1);}
+    }
 
-                return NULL;
-            }
-            // free message
-            free(messageToRec);
-            messageToRec = NULL;
+    if (started && pthread_create(&routerThread, NULL, routeInputLoop, NULL) == 0){
+        pthread_mutex_lock(&liveMutex);
+        while (liveSessions > 0){
+            pthread_cond_wait(&liveCond, &liveMutex);
+        }
+        pthread_mutex_unlock(&liveMutex);
 
-        } while (List_count(list) != 0); // output till list empty
+        pthread_cancel(routerThread);
+        pthread_join(routerThread, NULL);
     }
-    return NULL;
+
+    // no task runs once the pool is gone, so the sessions can be closed
+    Pool_destroy(pool);
+    for (int i = 0; i < numSessions; i++) {Session_close(sessions[i]);}
+    free(sessions);
+    return started ? 0 : -1;
 }
 
 int main(int argc, char const *argv[]) {
-    if (argc!=4) {
+    // arguments are one or more <myPort> <remoteHostname> <remotePort>
+    // triples, one per session, followed by optional arguments:
+    //   --transport=auto|udp|unix|shm picks the transport
+    //   --low-latency[=cpu,cpu,...] spins instead of sleeping and pins threads
+    //   --workers=N runs the sessions as tasks on a pool of N threads
+    int transportKind = TRANSPORT_AUTO;
+    int lowLatency = 0;
+    int threadCpus[SESSION_NUM_THREADS] = {-1, -1, -1, -1};
+    int numWorkers = 0;
+
+    int numEndpoints = 1;
+    while (numEndpoints < argc && strncmp(argv[numEndpoints], "--", 2) != 0) {numEndpoints++;}
+    numEndpoints--;
+    int valid = (numEndpoints >= 3 && numEndpoints % 3 == 0);
+
+    for (int i = numEndpoints + 1; i < argc && valid; i++) {
+        if (!strncmp(argv[i], "--transport=", 12)) {
+            transportKind = Transport_parseKind(argv[i] + 12);
+            valid = (transportKind != -1);
+        }
+        else if (!strcmp(argv[i], "--low-latency")) {
+            // one core per thread, wrapping around on smaller machines
+            int numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+            for (int t = 0; t < SESSION_NUM_THREADS; t++) {threadCpus[t] = t % numCpus;}
+            lowLatency = 1;
+        }
+        else if (!strncmp(argv[i], "--low-latency=", 14)) {
+            valid = (parseCpuList(argv[i] + 14, threadCpus) == 0);
+            lowLatency = 1;
+        }
+        else if (!strncmp(argv[i], "--workers=", 10)) {
+            char* end;
+            numWorkers = strtol(argv[i] + 10, &end, 10);
+            valid = (end != argv[i] + 10 && *end == '\0' && numWorkers >= 1);
+        }
+        else {
+            valid = 0;
+        }
+    }
+
+    // a single chat keeps its own threads unless a pool was asked for;
+    // sessions on a pool wait on their sockets with epoll, so they need a
+    // socket transport and can't spin
+    int count = numEndpoints / 3;
+    int pooled = (count > 1 || numWorkers > 0);
+    if (pooled) {
+        if (transportKind == TRANSPORT_AUTO) {transportKind = TRANSPORT_UDP;}
+        valid = valid && transportKind != TRANSPORT_SHM && !lowLatency;
+    }
+    if (!valid) {
         printf("Invalid arguments.\n");
         return -1;
     }
 
-    // store arguments
-    myPort = argv[1];
-    remoteHostname = argv[2];
-    remotePort = argv[3];
-
-    list = List_create();
-
-    // initiate threads
-    pthread_create(&inputThread, NULL, keyboardInputLoop, NULL);
-    pthread_create(&senderThread, NULL, sendMessageLoop, NULL);
-    pthread_create(&receiverThread, NULL, receiveMessageLoop, NULL);
-    pthread_create(&outputThread, NULL, screenOutputLoop, NULL);
-
-    // terminate threads
-    pthread_join(inputThread, NULL);
-    pthread_join(senderThread, NULL); 
-    pthread_join(receiverThread, NULL);
-    pthread_join(outputThread, NULL);
+    if (!pooled) {return runSession(transportKind, argv + 1, lowLatency, threadCpus);}
 
-    // close sockets and free memory
-    close(sockfdSend);
-    free(messageToSend);
-    messageToSend = NULL;
-
-    close(sockfdRec);
-    free(messageToRec);
-    messageToRec = NULL;
-
-    // free list
-    List_free(list, free);
-
-    return 0;
+    if (numWorkers == 0) {numWorkers = sysconf(_SC_NPROCESSORS_ONLN);}
+    return runPool(transportKind, argv + 1, count, numWorkers);
 }
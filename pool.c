@@ -0,0 +1,242 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "pool.h"
+
+ILIST_DEFINE(TaskQueue, PoolTask, link)
+
+enum PoolTaskState {
+    TASK_IDLE,
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_RERUN     // submitted while running
+};
+
+// the worker the calling thread is, if it is one
+static __thread PoolWorker* currentWorker = NULL;
+
+void PoolTask_init(PoolTask* pTask, POOL_TASK_FN run) {
+    pTask->link.prev = NULL;
+    pTask->link.next = NULL;
+    pTask->run = run;
+    atomic_init(&pTask->state, TASK_IDLE);
+}
+
+// put pTask on a worker's queue and wake a sleeping worker if there is one
+static void pushTask(Pool* pPool, PoolTask* pTask) {
+    // keep work submitted by a worker on that worker, where its data is warm
+    PoolWorker* worker = currentWorker;
+    if (worker == NULL || worker->pool != pPool) {
+        worker = &pPool->workers[atomic_fetch_add(&pPool->nextWorker, 1) % pPool->numWorkers];
+    }
+
+    atomic_fetch_add(&pPool->queued, 1);
+    pthread_mutex_lock(&worker->mutex);
+    TaskQueue_append(&worker->tasks, pTask);
+    pthread_mutex_unlock(&worker->mutex);
+
+    // pairs with the sleeping worker counting itself before checking queued,
+    // so either it sees this task or it is seen here
+    if (atomic_load(&pPool->numSleeping) > 0) {
+        pthread_mutex_lock(&pPool->sleepMutex);
+        pthread_cond_signal(&pPool->sleepCond);
+        pthread_mutex_unlock(&pPool->sleepMutex);
+    }
+}
+
+void Pool_submit(Pool* pPool, PoolTask* pTask) {
+    int state = atomic_load(&pTask->state);
+    int next;
+    do {
+        if (state == TASK_QUEUED || state == TASK_RERUN) {return;}
+        next = (state == TASK_IDLE) ? TASK_QUEUED : TASK_RERUN;
+    } while (!atomic_compare_exchange_weak(&pTask->state, &state, next));
+
+    // a running task is queued again by its worker once it returns
+    if (next == TASK_QUEUED) {pushTask(pPool, pTask);}
+}
+
+// take the task at the front of the worker's own queue
+static PoolTask* popTask(PoolWorker* worker) {
+    pthread_mutex_lock(&worker->mutex);
+    TaskQueue_first(&worker->tasks);
+    PoolTask* pTask = TaskQueue_remove(&worker->tasks);
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (pTask != NULL) {atomic_fetch_sub(&worker->pool->queued, 1);}
+    return pTask;
+}
+
+// take a task from the back of another worker's queue, away from where its
+// owner takes them
+static PoolTask* stealTask(PoolWorker* worker) {
+    Pool* pPool = worker->pool;
+
+    for (int i = 1; i < pPool->numWorkers; i++) {
+        PoolWorker* victim = &pPool->workers[(worker->index + i) % pPool->numWorkers];
+
+        pthread_mutex_lock(&victim->mutex);
+        PoolTask* pTask = TaskQueue_trim(&victim->tasks);
+        pthread_mutex_unlock(&victim->mutex);
+
+        if (pTask != NULL) {
+            atomic_fetch_sub(&pPool->queued, 1);
+            return pTask;
+        }
+    }
+    return NULL;
+}
+
+static void runTask(Pool* pPool, PoolTask* pTask) {
+    atomic_store(&pTask->state, TASK_RUNNING);
+    pTask->run(pTask);
+
+    // run it again, behind whatever is queued, if it was submitted meanwhile
+    int state = TASK_RUNNING;
+    if (!atomic_compare_exchange_strong(&pTask->state, &state, TASK_IDLE)) {
+        atomic_store(&pTask->state, TASK_QUEUED);
+        pushTask(pPool, pTask);
+    }
+}
+
+static void* workerLoop(void* args) {
+    PoolWorker* worker = args;
+    Pool* pPool = worker->pool;
+    currentWorker = worker;
+
+    while (1) {
+        PoolTask* pTask = popTask(worker);
+        if (pTask == NULL) {pTask = stealTask(worker);}
+        if (pTask != NULL) {
+            runTask(pPool, pTask);
+            continue;
+        }
+
+        // nothing to run anywhere: sleep until something is submitted
+        pthread_mutex_lock(&pPool->sleepMutex);
+        atomic_fetch_add(&pPool->numSleeping, 1);
+        while (atomic_load(&pPool->queued) == 0 && !pPool->stopping) {
+            pthread_cond_wait(&pPool->sleepCond, &pPool->sleepMutex);
+        }
+        atomic_fetch_sub(&pPool->numSleeping, 1);
+        bool stop = pPool->stopping && atomic_load(&pPool->queued) == 0;
+        pthread_mutex_unlock(&pPool->sleepMutex);
+
+        if (stop) {return NULL;}
+    }
+    return NULL;
+}
+
+static void* pollLoop(void* args) {
+    Pool* pPool = args;
+    struct epoll_event events[POOL_MAX_EVENTS];
+
+    while (1) {
+        int count = epoll_wait(pPool->epollFd, events, POOL_MAX_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            Pool_submit(pPool, events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+Pool* Pool_create(int numWorkers) {
+    if (numWorkers < 1) {return NULL;}
+
+    Pool* pPool = (Pool*) calloc(1, sizeof(Pool));
+    if (pPool == NULL) {return NULL;}
+    pPool->workers = (PoolWorker*) calloc(numWorkers, sizeof(PoolWorker));
+    pPool->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (pPool->workers == NULL || pPool->epollFd == -1) {
+        if (pPool->epollFd != -1) {close(pPool->epollFd);}
+        free(pPool->workers);
+        free(pPool);
+        return NULL;
+    }
+
+    atomic_init(&pPool->queued, 0);
+    atomic_init(&pPool->numSleeping, 0);
+    atomic_init(&pPool->nextWorker, 0);
+    pthread_mutex_init(&pPool->sleepMutex, NULL);
+    pthread_cond_init(&pPool->sleepCond, NULL);
+    pPool->stopping = false;
+    pPool->pollerStarted = false;
+
+    // set every worker up before any starts, as they steal from each other
+    for (int i = 0; i < numWorkers; i++) {
+        PoolWorker* worker = &pPool->workers[i];
+        worker->pool = pPool;
+        worker->index = i;
+        pthread_mutex_init(&worker->mutex, NULL);
+        IList_init(&worker->tasks);
+    }
+    pPool->numWorkers = numWorkers;
+
+    for (int i = 0; i < numWorkers; i++) {
+        if (pthread_create(&pPool->workers[i].thread, NULL, workerLoop, &pPool->workers[i]) != 0) {
+            // the workers that did start have nothing to do and exit
+            pPool->numWorkers = i;
+            Pool_destroy(pPool);
+            return NULL;
+        }
+    }
+    if (pthread_create(&pPool->pollerThread, NULL, pollLoop, pPool) != 0) {
+        Pool_destroy(pPool);
+        return NULL;
+    }
+    pPool->pollerStarted = true;
+
+    return pPool;
+}
+
+static int watchFd(Pool* pPool, int op, int fd, uint32_t events, PoolTask* pTask) {
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = pTask;
+    return (epoll_ctl(pPool->epollFd, op, fd, &event) == -1) ? POOL_FAIL : POOL_SUCCESS;
+}
+
+int Pool_watch(Pool* pPool, int fd, PoolTask* pTask) {
+    return watchFd(pPool, EPOLL_CTL_ADD, fd, EPOLLIN, pTask);
+}
+
+int Pool_rearm(Pool* pPool, int fd, PoolTask* pTask) {
+    return watchFd(pPool, EPOLL_CTL_MOD, fd, EPOLLIN, pTask);
+}
+
+int Pool_watchWritable(Pool* pPool, int fd, PoolTask* pTask) {
+    // fd stays registered after its first use, so only the first call adds it
+    if (watchFd(pPool, EPOLL_CTL_MOD, fd, EPOLLOUT, pTask) == POOL_SUCCESS) {return POOL_SUCCESS;}
+    if (errno != ENOENT) {return POOL_FAIL;}
+    return watchFd(pPool, EPOLL_CTL_ADD, fd, EPOLLOUT, pTask);
+}
+
+void Pool_unwatch(Pool* pPool, int fd) {
+    epoll_ctl(pPool->epollFd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void Pool_destroy(Pool* pPool) {
+    // the poller only ever waits in epoll_wait, so it can be cancelled there
+    if (pPool->pollerStarted) {
+        pthread_cancel(pPool->pollerThread);
+        pthread_join(pPool->pollerThread, NULL);
+    }
+
+    pthread_mutex_lock(&pPool->sleepMutex);
+    pPool->stopping = true;
+    pthread_cond_broadcast(&pPool->sleepCond);
+    pthread_mutex_unlock(&pPool->sleepMutex);
+
+    for (int i = 0; i < pPool->numWorkers; i++) {
+        pthread_join(pPool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pPool->workers[i].mutex);
+    }
+
+    close(pPool->epollFd);
+    pthread_mutex_destroy(&pPool->sleepMutex);
+    pthread_cond_destroy(&pPool->sleepCond);
+    free(pPool->workers);
+    free(pPool);
+}
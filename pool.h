@@ -0,0 +1,94 @@
+// Worker thread pool
+// Runs tasks on a fixed set of worker threads. Every worker has a task queue of
+// its own: a task submitted by a worker goes on that worker's queue, tasks from
+// other threads are dealt out to the workers in turn, and a worker whose queue
+// runs dry steals from the back of the others' queues before it goes to sleep.
+// A task never runs on two workers at once. Submitting a task that is already
+// queued does nothing, and submitting one that is running makes it run again
+// once it returns, so a task can be submitted whenever it has new work.
+// The pool can also watch file descriptors and submit a task whenever its
+// descriptor turns readable, or once when it turns writable.
+
+#ifndef _POOL_H_
+#define _POOL_H_
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "ilist.h"
+
+#define POOL_SUCCESS 0
+#define POOL_FAIL -1
+
+// Most readiness events the poller thread takes from epoll at once
+#define POOL_MAX_EVENTS 64
+
+typedef struct PoolTask_s PoolTask;
+
+// Runs pTask. A task must stay allocated for as long as it can be submitted.
+typedef void (*POOL_TASK_FN)(PoolTask* pTask);
+
+// Embed a PoolTask in anything that is to be run on the pool.
+struct PoolTask_s {
+    IListLink link;
+    POOL_TASK_FN run;
+    atomic_int state;
+};
+
+typedef struct Pool_s Pool;
+
+typedef struct PoolWorker_s PoolWorker;
+struct PoolWorker_s {
+    Pool* pool;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    IList tasks;
+};
+
+struct Pool_s {
+    PoolWorker* workers;
+    int numWorkers;
+    atomic_int queued;          // tasks waiting in any worker's queue
+    atomic_int numSleeping;     // workers waiting on sleepCond
+    atomic_uint nextWorker;     // worker the next outside submission goes to
+    pthread_mutex_t sleepMutex;
+    pthread_cond_t sleepCond;
+    bool stopping;
+    int epollFd;
+    pthread_t pollerThread;
+    bool pollerStarted;
+};
+
+// Makes pTask a task that calls run.
+void PoolTask_init(PoolTask* pTask, POOL_TASK_FN run);
+
+// Starts a pool of numWorkers workers.
+// Returns NULL on failure.
+Pool* Pool_create(int numWorkers);
+
+// Has pTask run on one of the workers.
+void Pool_submit(Pool* pPool, PoolTask* pTask);
+
+// Submits pTask the next time fd turns readable. The pool then stops watching
+// fd until Pool_rearm is called, so pTask can read at its own pace.
+// Returns 0 on success, -1 on failure.
+int Pool_watch(Pool* pPool, int fd, PoolTask* pTask);
+
+// Watches fd for pTask again after it was submitted by Pool_watch.
+// Returns 0 on success, -1 on failure.
+int Pool_rearm(Pool* pPool, int fd, PoolTask* pTask);
+
+// Submits pTask once fd turns writable, then stops watching fd until this is
+// called again. fd must not also be watched with Pool_watch.
+// Returns 0 on success, -1 on failure.
+int Pool_watchWritable(Pool* pPool, int fd, PoolTask* pTask);
+
+// Stops watching fd.
+void Pool_unwatch(Pool* pPool, int fd);
+
+// Stops watching every descriptor, waits for the workers to run every queued
+// task and frees pPool.
+void Pool_destroy(Pool* pPool);
+
+#endif
@@ -0,0 +1,218 @@
+#include <time.h>
+
+#include "scheduler.h"
+
+ILIST_DEFINE(SchedQueue, SchedItem, link)
+
+static const int quantums[NUM_TRAFFIC_CLASSES] = {0, SCHED_QUANTUM_INTERACTIVE, SCHED_QUANTUM_BULK};
+
+static uint64_t nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// cancellation cleanup for threads waiting on the scheduler's conds
+static void unlockMutex(void* mutex) {
+    pthread_mutex_unlock((pthread_mutex_t*) mutex);
+}
+
+void Scheduler_init(Scheduler* pScheduler) {
+    pthread_mutex_init(&pScheduler->mutex, NULL);
+    pthread_cond_init(&pScheduler->itemCond, NULL);
+    pthread_cond_init(&pScheduler->spaceCond, NULL);
+
+    for (int c = 0; c < NUM_TRAFFIC_CLASSES; c++) {
+        IList_init(&pScheduler->queues[c]);
+        pScheduler->deficit[c] = 0;
+        pScheduler->stats[c] = (SchedStats) {0};
+    }
+    pScheduler->drrClass = TRAFFIC_INTERACTIVE;
+    pScheduler->drrCredited = 0;
+    pScheduler->closed = false;
+    pScheduler->notify = NULL;
+    pScheduler->notifyArg = NULL;
+}
+
+void Scheduler_setNotify(Scheduler* pScheduler, SCHED_NOTIFY_FN notify, void* arg) {
+    pthread_mutex_lock(&pScheduler->mutex);
+    pScheduler->notify = notify;
+    pScheduler->notifyArg = arg;
+    pthread_mutex_unlock(&pScheduler->mutex);
+}
+
+void Scheduler_enqueue(Scheduler* pScheduler, SchedItem* pItem, int trafficClass, int cost) {
+    pItem->trafficClass = trafficClass;
+    pItem->cost = cost;
+
+    bool closed;
+    SCHED_NOTIFY_FN notify;
+    void* notifyArg;
+
+    pthread_mutex_lock(&pScheduler->mutex);
+    pthread_cleanup_push(unlockMutex, &pScheduler->mutex);
+
+    IList* queue = &pScheduler->queues[trafficClass];
+    while (trafficClass == TRAFFIC_BULK && IList_count(queue) >= SCHED_MAX_BULK_DEPTH &&
+           !pScheduler->closed) {
+        pthread_cond_wait(&pScheduler->spaceCond, &pScheduler->mutex);
+    }
+    closed = pScheduler->closed;
+    notify = pScheduler->notify;
+    notifyArg = pScheduler->notifyArg;
+
+    if (!closed) {
+        pItem->enqueuedNs = nowNs();
+        SchedQueue_append(queue, pItem);
+
+        SchedStats* stats = &pScheduler->stats[trafficClass];
+        stats->depth = IList_count(queue);
+        if (stats->depth > stats->maxDepth) {stats->maxDepth = stats->depth;}
+
+        pthread_cond_signal(&pScheduler->itemCond);
+    }
+    pthread_cleanup_pop(1);
+
+    // both callbacks may take locks of their own, so they run unlocked
+    if (closed) {pItem->discard(pItem);}
+    else if (notify != NULL) {notify(notifyArg);}
+}
+
+// take the item at the front of trafficClass's queue
+static SchedItem* takeFirst(Scheduler* pScheduler, int trafficClass) {
+    IList* queue = &pScheduler->queues[trafficClass];
+    SchedQueue_first(queue);
+    SchedItem* pItem = SchedQueue_remove(queue);
+
+    uint64_t waitNs = nowNs() - pItem->enqueuedNs;
+    SchedStats* stats = &pScheduler->stats[trafficClass];
+    stats->depth = IList_count(queue);
+    stats->dequeued++;
+    stats->bytes += pItem->cost;
+    stats->totalWaitNs += waitNs;
+    if (waitNs > stats->maxWaitNs) {stats->maxWaitNs = waitNs;}
+
+    if (trafficClass == TRAFFIC_BULK) {pthread_cond_signal(&pScheduler->spaceCond);}
+    return pItem;
+}
+
+static SchedItem* dequeueLocked(Scheduler* pScheduler) {
+    // control frames never wait behind anything
+    if (IList_count(&pScheduler->queues[TRAFFIC_CONTROL]) > 0) {
+        return takeFirst(pScheduler, TRAFFIC_CONTROL);
+    }
+    if (IList_count(&pScheduler->queues[TRAFFIC_INTERACTIVE]) == 0 &&
+        IList_count(&pScheduler->queues[TRAFFIC_BULK]) == 0) {
+        return NULL;
+    }
+
+    // deficit round robin between interactive and bulk; every visit to a
+    // backlogged class adds to its credit, so this always terminates
+    while (1) {
+        int c = pScheduler->drrClass;
+        IList* queue = &pScheduler->queues[c];
+
+        if (IList_count(queue) > 0) {
+            if (!pScheduler->drrCredited) {
+                pScheduler->deficit[c] += quantums[c];
+                pScheduler->drrCredited = 1;
+            }
+
+            SchedItem* pItem = SchedQueue_entry(queue->head);
+            if (pItem->cost <= pScheduler->deficit[c]) {
+                pScheduler->deficit[c] -= pItem->cost;
+                return takeFirst(pScheduler, c);
+            }
+        }
+        else {
+            // an idle class doesn't bank credit
+            pScheduler->deficit[c] = 0;
+        }
+
+        // out of credit or nothing queued: the other class's turn
+        pScheduler->drrClass = (c == TRAFFIC_INTERACTIVE) ? TRAFFIC_BULK : TRAFFIC_INTERACTIVE;
+        pScheduler->drrCredited = 0;
+    }
+}
+
+SchedItem* Scheduler_tryDequeue(Scheduler* pScheduler) {
+    pthread_mutex_lock(&pScheduler->mutex);
+    SchedItem* pItem = dequeueLocked(pScheduler);
+    pthread_mutex_unlock(&pScheduler->mutex);
+    return pItem;
+}
+
+SchedItem* Scheduler_dequeue(Scheduler* pScheduler) {
+    SchedItem* pItem;
+
+    pthread_mutex_lock(&pScheduler->mutex);
+    pthread_cleanup_push(unlockMutex, &pScheduler->mutex);
+    while ((pItem = dequeueLocked(pScheduler)) == NULL && !pScheduler->closed) {
+        pthread_cond_wait(&pScheduler->itemCond, &pScheduler->mutex);
+    }
+    pthread_cleanup_pop(1);
+
+    return pItem;
+}
+
+void Scheduler_requeue(Scheduler* pScheduler, SchedItem* pItem) {
+    int c = pItem->trafficClass;
+
+    pthread_mutex_lock(&pScheduler->mutex);
+    bool closed = pScheduler->closed;
+    if (!closed) {
+        IList* queue = &pScheduler->queues[c];
+        SchedQueue_prepend(queue, pItem);
+
+        // take back what dequeueing it cost; the time it waits from now on
+        // counts as a second wait of the same item
+        if (c != TRAFFIC_CONTROL) {pScheduler->deficit[c] += pItem->cost;}
+        pItem->enqueuedNs = nowNs();
+        SchedStats* stats = &pScheduler->stats[c];
+        stats->depth = IList_count(queue);
+        stats->dequeued--;
+        stats->bytes -= pItem->cost;
+    }
+    pthread_mutex_unlock(&pScheduler->mutex);
+
+    if (closed) {pItem->discard(pItem);}
+}
+
+bool Scheduler_isClosed(Scheduler* pScheduler) {
+    pthread_mutex_lock(&pScheduler->mutex);
+    bool closed = pScheduler->closed;
+    pthread_mutex_unlock(&pScheduler->mutex);
+    return closed;
+}
+
+void Scheduler_getStats(Scheduler* pScheduler, int trafficClass, SchedStats* pStats) {
+    pthread_mutex_lock(&pScheduler->mutex);
+    *pStats = pScheduler->stats[trafficClass];
+    pthread_mutex_unlock(&pScheduler->mutex);
+}
+
+void Scheduler_close(Scheduler* pScheduler) {
+    IList discarded = ILIST_INIT;
+
+    pthread_mutex_lock(&pScheduler->mutex);
+    pScheduler->closed = true;
+    for (int c = 0; c < NUM_TRAFFIC_CLASSES; c++) {
+        IList_concat(&discarded, &pScheduler->queues[c]);
+        pScheduler->stats[c].depth = 0;
+    }
+    pthread_cond_broadcast(&pScheduler->itemCond);
+    pthread_cond_broadcast(&pScheduler->spaceCond);
+    pthread_mutex_unlock(&pScheduler->mutex);
+
+    // discard routines may take locks of their own, so they run unlocked
+    SchedItem* pItem;
+    while ((pItem = SchedQueue_trim(&discarded)) != NULL) {
+        pItem->discard(pItem);
+    }
+}
+
+void Scheduler_destroy(Scheduler* pScheduler) {
+    pthread_mutex_destroy(&pScheduler->mutex);
+    pthread_cond_destroy(&pScheduler->itemCond);
+    pthread_cond_destroy(&pScheduler->spaceCond);
+}
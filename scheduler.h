@@ -0,0 +1,125 @@
+// Send scheduler
+// Everything sent to the remote peer is queued here by traffic class and
+// handed to the sender thread in scheduling order. Control frames always go
+// first. Interactive chat and bulk file data share what is left by deficit
+// round robin: each turn a class may send up to its quantum of bytes, so a
+// chat line never waits behind more than one quantum of bulk data while bulk
+// data still fills the link whenever nothing else is queued.
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ilist.h"
+
+enum TrafficClass {
+    TRAFFIC_CONTROL,      // termination, transfer acknowledgements
+    TRAFFIC_INTERACTIVE,  // chat lines
+    TRAFFIC_BULK,         // file data
+    NUM_TRAFFIC_CLASSES
+};
+
+// Bytes each class may send per round robin turn
+#define SCHED_QUANTUM_INTERACTIVE 4096
+#define SCHED_QUANTUM_BULK 65536
+
+// Bulk items that may be queued before Scheduler_enqueue blocks, so a file
+// transfer can't queue the whole file at once
+#define SCHED_MAX_BULK_DEPTH 16
+
+// Values returned by an item's send routine
+#define SCHED_SENT 0
+#define SCHED_STOP 1     // the sender should stop after this item
+#define SCHED_BLOCKED 2  // the transport had no room; the item was kept for Scheduler_requeue
+#define SCHED_FAIL -1
+
+typedef struct SchedItem_s SchedItem;
+
+// Sends pItem and frees it, unless it returns SCHED_BLOCKED. Returns SCHED_SENT,
+// SCHED_STOP, SCHED_BLOCKED or SCHED_FAIL.
+typedef int (*SCHED_SEND_FN)(SchedItem* pItem);
+
+// Frees pItem without sending it.
+typedef void (*SCHED_DISCARD_FN)(SchedItem* pItem);
+
+// Called after every enqueue with the argument given to Scheduler_setNotify.
+typedef void (*SCHED_NOTIFY_FN)(void* arg);
+
+// Embed a SchedItem in anything that is to be queued for sending.
+struct SchedItem_s {
+    IListLink link;
+    SCHED_SEND_FN send;
+    SCHED_DISCARD_FN discard;
+    int trafficClass;
+    int cost;             // bytes the item puts on the wire
+    uint64_t enqueuedNs;
+};
+
+typedef struct SchedStats_s SchedStats;
+struct SchedStats_s {
+    int depth;            // items queued now
+    int maxDepth;         // most items ever queued at once
+    uint64_t dequeued;    // items handed to the sender
+    uint64_t bytes;       // cost of those items
+    uint64_t totalWaitNs; // time they spent queued
+    uint64_t maxWaitNs;
+};
+
+typedef struct Scheduler_s Scheduler;
+struct Scheduler_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t itemCond;   // an item was queued
+    pthread_cond_t spaceCond;  // a bulk item was dequeued
+    IList queues[NUM_TRAFFIC_CLASSES];
+    int deficit[NUM_TRAFFIC_CLASSES];
+    int drrClass;              // class whose round robin turn it is
+    int drrCredited;           // whether drrClass got its quantum this turn
+    SchedStats stats[NUM_TRAFFIC_CLASSES];
+    bool closed;
+    SCHED_NOTIFY_FN notify;
+    void* notifyArg;
+};
+
+// Makes pScheduler an empty scheduler.
+void Scheduler_init(Scheduler* pScheduler);
+
+// Has notify(arg) called after every enqueue, for senders that run as tasks
+// instead of waiting in Scheduler_dequeue.
+void Scheduler_setNotify(Scheduler* pScheduler, SCHED_NOTIFY_FN notify, void* arg);
+
+// Queues pItem in trafficClass; cost is the number of bytes it will send.
+// Blocks while SCHED_MAX_BULK_DEPTH bulk items are queued. Once the scheduler
+// is closed, pItem is discarded instead.
+void Scheduler_enqueue(Scheduler* pScheduler, SchedItem* pItem, int trafficClass, int cost);
+
+// Returns the next item to send, or NULL if nothing is queued.
+SchedItem* Scheduler_tryDequeue(Scheduler* pScheduler);
+
+// Returns the next item to send, waiting until one is queued, or NULL once
+// the scheduler is closed.
+SchedItem* Scheduler_dequeue(Scheduler* pScheduler);
+
+// Puts pItem, just dequeued and blocked, back at the front of its class so it
+// is the next of its class to be sent, or discards it once the scheduler is
+// closed. Never blocks, and doesn't call the notify hook.
+void Scheduler_requeue(Scheduler* pScheduler, SchedItem* pItem);
+
+// Returns true once Scheduler_close has been called.
+bool Scheduler_isClosed(Scheduler* pScheduler);
+
+// Copies the metrics of trafficClass into pStats.
+void Scheduler_getStats(Scheduler* pScheduler, int trafficClass, SchedStats* pStats);
+
+// Discards every queued item and every item queued from now on, waking
+// anyone blocked in Scheduler_enqueue or Scheduler_dequeue. An item being
+// sent when the scheduler closes is still sent to the end, so a sender must
+// be stopped this way rather than by cancelling it.
+void Scheduler_close(Scheduler* pScheduler);
+
+// Releases what Scheduler_init set up. The scheduler must be closed and no
+// thread may be using it any more.
+void Scheduler_destroy(Scheduler* pScheduler);
+
+#endif
@@ -0,0 +1,593 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "session.h"
+#include "spin.h"
+
+#define BUFLEN 1024
+
+// a chat message; typed messages are queued on the send scheduler through
+// their item, received ones on the message list through the item's link, so
+// queueing either never needs a node from the list pool
+struct Message_s {
+    SchedItem item;
+    Session* session;
+    char text[];
+};
+ILIST_DEFINE(MessageList, Message, item.link)
+
+// what a line of input turned out to be
+enum InputKind {INPUT_MESSAGE, INPUT_COMMAND, INPUT_END};
+
+// write len bytes of text after the session's label and prefix in a single
+// call, so lines printed by different sessions never interleave
+static int printText(Session* pSession, const char* prefix, const char* text, int len){
+    struct iovec iov[3];
+    iov[0].iov_base = pSession->label;
+    iov[0].iov_len = strlen(pSession->label);
+    iov[1].iov_base = (void*) prefix;
+    iov[1].iov_len = strlen(prefix);
+    iov[2].iov_base = (void*) text;
+    iov[2].iov_len = len;
+    return writev(1, iov, 3);
+}
+
+static int lockedCount(Session* pSession, IList* pList){
+    pthread_mutex_lock(&pSession->listMutex);
+    int count = IList_count(pList);
+    pthread_mutex_unlock(&pSession->listMutex);
+    return count;
+}
+
+// wait until pList holds a message, sleeping on cond or, in low-latency
+// mode, spinning so the handoff doesn't wait for the scheduler
+static void waitForMessage(Session* pSession, IList* pList, pthread_mutex_t* mutex, pthread_cond_t* cond){
+    if (pSession->lowLatency){
+        SpinBackoff backoff = SPIN_BACKOFF_INIT;
+        while (lockedCount(pSession, pList) == 0){
+            pthread_testcancel();
+            Spin_backoff(&backoff);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(mutex);
+    while (lockedCount(pSession, pList) == 0){
+        pthread_cond_wait(cond, mutex);
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+// copy len bytes of data into a new message
+static Message* newMessage(Session* pSession, const char* data, int len){
+    Message* msg = (Message*) malloc(sizeof(Message) + len + 1);
+    msg->session = pSession;
+    strncpy(msg->text, data, len);
+    msg->text[len] = '\0';
+    return msg;
+}
+
+// free every message left in pList
+static void freeMessages(IList* pList){
+    Message* msg;
+    while ((msg = MessageList_trim(pList)) != NULL){
+        free(msg);
+    }
+}
+
+// send a chat message and free it, or keep it if the transport has no room
+static int sendChatMessage(SchedItem* pItem){
+    Message* msg = ILIST_CONTAINER_OF(pItem, Message, item);
+    Session* pSession = msg->session;
+
+    // send message and report whether it was a single '!'
+    int val = Transport_send(pSession->transport, msg->text, strlen(msg->text));
+    int isEnd = !strcmp(msg->text, "!\n");
+
+    if (val == TRANSPORT_WOULD_BLOCK) {return SCHED_BLOCKED;}
+    free(msg);
+
+    if (val == TRANSPORT_FAIL) {return SCHED_FAIL;}
+    return isEnd ? SCHED_STOP : SCHED_SENT;
+}
+
+static void discardChatMessage(SchedItem* pItem){
+    free(ILIST_CONTAINER_OF(pItem, Message, item));
+}
+
+// print the send scheduler's metrics for each traffic class
+static void printStats(Session* pSession){
+    static const char* classNames[NUM_TRAFFIC_CLASSES] = {"control", "interactive", "bulk"};
+    char line[BUFLEN];
+
+    for (int c = 0; c < NUM_TRAFFIC_CLASSES; c++){
+        SchedStats stats;
+        Scheduler_getStats(&pSession->scheduler, c, &stats);
+        unsigned long long avgWaitUs = (stats.dequeued > 0) ? stats.totalWaitNs / stats.dequeued / 1000 : 0;
+
+        int len = snprintf(line, BUFLEN,
+            "%-11s queued %d (max %d), sent %llu (%llu bytes), wait avg %llu us max %llu us\n",
+            classNames[c], stats.depth, stats.maxDepth,
+            (unsigned long long) stats.dequeued, (unsigned long long) stats.bytes,
+            avgWaitUs, (unsigned long long) stats.maxWaitNs / 1000);
+        printText(pSession, "", line, len);
+    }
+}
+
+// handle a "/send <file> [offset]" or "/stats" line typed by the user.
+// Returns 1 if the line was a command and must not be sent as chat.
+static int handleCommand(Session* pSession, char* line){
+    if (!strcmp(line, "/stats\n")){
+        printStats(pSession);
+        return 1;
+    }
+    if (strncmp(line, "/send ", 6) != 0) {return 0;}
+
+    char path[BUFLEN];
+    long long offset = 0;
+    if (sscanf(line + 6, "%1023s %lld", path, &offset) < 1 || offset < 0){
+        char* usage = "Usage: /send <file> [offset]\n";
+        printText(pSession, "", usage, strlen(usage));
+        return 1;
+    }
+    Transfer_send(pSession->transfer, path, offset);
+    return 1;
+}
+
+// handle len bytes of typed input holding at most one line: run it if it
+// is a command, queue it to send otherwise
+static int queueInput(Session* pSession, const char* data, int len){
+    // only a whole line is looked at, not the rest of one longer than a read
+    bool lineStart = !pSession->midLine;
+    pSession->midLine = (data[len - 1] != '\n');
+
+    // copy input to malloc'd message of exact size to queue
+    Message* msg = newMessage(pSession, data, len);
+
+    // commands are handled here instead of being sent
+    if (lineStart && handleCommand(pSession, msg->text)){
+        free(msg);
+        return INPUT_COMMAND;
+    }
+
+    // queue message to send; a single '!' goes ahead of
+    // everything else, other lines take turns with file data
+    int isEnd = lineStart && !strcmp(msg->text, "!\n");
+    msg->item.send = sendChatMessage;
+    msg->item.discard = discardChatMessage;
+    Scheduler_enqueue(&pSession->scheduler, &msg->item, isEnd ? TRAFFIC_CONTROL : TRAFFIC_INTERACTIVE, len);
+
+    return isEnd ? INPUT_END : INPUT_MESSAGE;
+}
+
+// handle len bytes of typed input one line at a time, since a single read
+// may return several lines. Returns INPUT_END once a single '!' is queued.
+static int queueLines(Session* pSession, const char* data, int len){
+    int kind = INPUT_MESSAGE;
+    while (len > 0 && kind != INPUT_END){
+        const char* newline = memchr(data, '\n', len);
+        int lineLen = (newline != NULL) ? newline - data + 1 : len;
+
+        kind = queueInput(pSession, data, lineLen);
+        data += lineLen;
+        len -= lineLen;
+    }
+    return kind;
+}
+
+static void* keyboardInputLoop(void* args){
+    Session* pSession = args;
+
+    while(1){
+        char buffer[BUFLEN];
+        int size;
+
+        // record size of message and save it in buffer
+        do {
+            size = read(0, buffer, BUFLEN);
+        } while (size == -1 && errno == EINTR);
+
+        // end of input: nothing more will be typed, so stop reading
+        // but keep showing the remote peer's messages until it ends
+        // the chat
+        if (size <= 0) {return NULL;}
+
+        // if a single '!' was typed, terminate chat and cancel threads
+        if (queueLines(pSession, buffer, size) == INPUT_END){
+            pthread_cancel(pSession->threads[SESSION_OUTPUT_THREAD]);
+            pthread_cancel(pSession->threads[SESSION_RECEIVER_THREAD]);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// wait for the next item to send, spinning instead of sleeping in
+// low-latency mode. Returns NULL once the scheduler is closed.
+static SchedItem* nextToSend(Session* pSession){
+    if (!pSession->lowLatency) {return Scheduler_dequeue(&pSession->scheduler);}
+
+    SpinBackoff backoff = SPIN_BACKOFF_INIT;
+    SchedItem* pItem;
+    while ((pItem = Scheduler_tryDequeue(&pSession->scheduler)) == NULL){
+        if (Scheduler_isClosed(&pSession->scheduler)) {return NULL;}
+        Spin_backoff(&backoff);
+    }
+    return pItem;
+}
+
+static void* sendMessageLoop(void* args) {
+    Session* pSession = args;
+
+    while (1) {
+        // send whatever the scheduler picks next: control traffic first,
+        // then chat and file data taking turns
+        SchedItem* pItem = nextToSend(pSession);
+
+        // the remote peer ended the chat
+        if (pItem == NULL) {return NULL;}
+
+        int val = pItem->send(pItem);
+        if (val == SCHED_FAIL) {
+            char failMessage[BUFLEN];
+            int len = snprintf(failMessage, BUFLEN, "Cannot send to remote peer: %s\n", strerror(errno));
+            printText(pSession, "", failMessage, len);
+            exit(-1);
+        }
+
+        // only a non-blocking transport runs out of room; send the item
+        // again once it has some
+        if (val == SCHED_BLOCKED) {
+            Scheduler_requeue(&pSession->scheduler, pItem);
+            struct pollfd pfd = {.fd = pSession->transport->sendPollFd, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        // if sent message was a single '!' output chat terminated and exit
+        if (val == SCHED_STOP) {
+            char* endMessage = "Chat terminated\n";
+            printText(pSession, "", endMessage, strlen(endMessage));
+
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static void* receiveMessageLoop(void* args) {
+    Session* pSession = args;
+    char buffer[TRANSPORT_RECV_BUFLEN];
+    Message* msg;
+    int size;
+    int segmentSize;
+
+    while (1){
+        // receive from remote peer and store in buffer
+        size = Transport_recv(pSession->transport, buffer, TRANSPORT_RECV_BUFLEN, &segmentSize);
+        if(size == -1){exit(-1);}
+
+        // buffer holds one datagram, or several of segmentSize bytes each
+        // if the kernel coalesced them
+        for (int pos = 0; pos < size; pos += segmentSize) {
+            char* datagram = buffer + pos;
+            int len = (size - pos < segmentSize) ? size - pos : segmentSize;
+
+            // file transfer frames never reach the chat list
+            if (Transfer_isFrame(datagram, len)){
+                Transfer_receive(pSession->transfer, datagram, len);
+                continue;
+            }
+
+            // copy datagram to malloc'd message of exact size to
+            // add to list
+            msg = newMessage(pSession, datagram, len);
+
+            // lock list and prepend message to receive
+            pthread_mutex_lock(&pSession->listMutex);
+            MessageList_prepend(&pSession->recList, msg);
+            pthread_mutex_unlock(&pSession->listMutex);
+
+            // if message was a single '!', terminate chat: cancel the
+            // input thread and close the scheduler, which stops the sender
+            // once it is done with what it is sending, so a file transfer
+            // is never left waiting for a batch
+            if(!strcmp(msg->text, "!\n"))
+            {
+                pthread_mutex_lock(&pSession->recMutex);
+                pthread_cond_signal(&pSession->recCond);
+                pthread_mutex_unlock(&pSession->recMutex);
+
+                pthread_cancel(pSession->threads[SESSION_INPUT_THREAD]);
+                Scheduler_close(&pSession->scheduler);
+
+                return NULL;
+            }
+
+            // signal output thread to continue once a full line
+            // has been added and list is accessible
+            if (datagram[len-1] == '\n'){
+                pthread_mutex_lock(&pSession->recMutex);
+                pthread_cond_signal(&pSession->recCond);
+                pthread_mutex_unlock(&pSession->recMutex);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void* screenOutputLoop(void* args) {
+    Session* pSession = args;
+
+    while (1){
+        // wait until the receiver thread has put a message
+        // in the list ready to output
+        waitForMessage(pSession, &pSession->recList, &pSession->recMutex, &pSession->recCond);
+
+        do {
+            // lock list and trim message to output
+            pthread_mutex_lock(&pSession->listMutex);
+            pSession->messageToRec = MessageList_trim(&pSession->recList);
+            pthread_mutex_unlock(&pSession->listMutex);
+
+            // write message after a prefix to differentiate local and
+            // remote messages, and assert success
+            char* text = pSession->messageToRec->text;
+            int writeVal = printText(pSession, "Remote: ", text, strlen(text));
+            if(writeVal == -1) {exit(-1);}
+
+            // if received message is a single '!' output chat terminated and exit
+            if(!strcmp(text, "!\n")) {
+                free(pSession->messageToRec);
+                pSession->messageToRec = NULL;
+
+                char* endMessage = "Chat terminated\n";
+                printText(pSession, "", endMessage, strlen(endMessage));
+
+                return NULL;
+            }
+            // free message
+            free(pSession->messageToRec);
+            pSession->messageToRec = NULL;
+
+        } while (lockedCount(pSession, &pSession->recList) != 0); // output till list empty
+    }
+    return NULL;
+}
+
+// start a thread running loop on the session, pinned to cpu unless it is -1
+static void startThread(Session* pSession, pthread_t* thread, void* (*loop)(void*), int cpu){
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (cpu >= 0){
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuSet), &cpuSet);
+    }
+
+    if (pthread_create(thread, &attr, loop, pSession) != 0){
+        printf("Cannot start thread on core %d.\n", cpu);
+        exit(-1);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+Session* Session_open(int transportKind, const char* myPort, const char* remoteHostname,
+                      const char* remotePort, const char* label) {
+    if (strlen(label) > SESSION_MAX_LABEL) {return NULL;}
+
+    Session* pSession = (Session*) calloc(1, sizeof(Session));
+    if (pSession == NULL) {return NULL;}
+    strcpy(pSession->label, label);
+
+    // open the transport before anything needs it
+    pSession->transport = Transport_open(transportKind, myPort, remoteHostname, remotePort);
+    if (pSession->transport == NULL) {
+        free(pSession);
+        return NULL;
+    }
+    Scheduler_init(&pSession->scheduler);
+    pSession->transfer = Transfer_create(pSession->transport, &pSession->scheduler, label);
+    if (pSession->transfer == NULL) {
+        Transport_close(pSession->transport);
+        free(pSession);
+        return NULL;
+    }
+
+    for (int i = 0; i < SESSION_NUM_THREADS; i++) {pSession->threadCpus[i] = -1;}
+    pSession->lowLatency = false;
+    IList_init(&pSession->recList);
+    pthread_mutex_init(&pSession->listMutex, NULL);
+    pthread_mutex_init(&pSession->recMutex, NULL);
+    pthread_cond_init(&pSession->recCond, NULL);
+
+    pSession->pool = NULL;
+    atomic_init(&pSession->ended, false);
+    return pSession;
+}
+
+void Session_setLowLatency(Session* pSession, const int* threadCpus) {
+    for (int i = 0; i < SESSION_NUM_THREADS; i++) {pSession->threadCpus[i] = threadCpus[i];}
+    pSession->lowLatency = true;
+    Transport_setLowLatency(pSession->transport);
+}
+
+void Session_run(Session* pSession) {
+    // initiate threads
+    startThread(pSession, &pSession->threads[SESSION_INPUT_THREAD], keyboardInputLoop,
+                pSession->threadCpus[SESSION_INPUT_THREAD]);
+    startThread(pSession, &pSession->threads[SESSION_SENDER_THREAD], sendMessageLoop,
+                pSession->threadCpus[SESSION_SENDER_THREAD]);
+    startThread(pSession, &pSession->threads[SESSION_RECEIVER_THREAD], receiveMessageLoop,
+                pSession->threadCpus[SESSION_RECEIVER_THREAD]);
+    startThread(pSession, &pSession->threads[SESSION_OUTPUT_THREAD], screenOutputLoop,
+                pSession->threadCpus[SESSION_OUTPUT_THREAD]);
+
+    // terminate threads
+    for (int i = 0; i < SESSION_NUM_THREADS; i++) {
+        pthread_join(pSession->threads[i], NULL);
+    }
+
+    // free memory
+    free(pSession->messageToRec);
+    pSession->messageToRec = NULL;
+}
+
+// stop a session on a pool once its chat is terminated from either side;
+// only the first call does anything
+static void endSession(Session* pSession) {
+    if (atomic_exchange(&pSession->ended, true)) {return;}
+
+    // stop receiving and drop anything left unsent; a task that is
+    // already queued finds the session ended and returns
+    Pool_unwatch(pSession->pool, pSession->transport->pollFd);
+    Pool_unwatch(pSession->pool, pSession->transport->sendPollFd);
+    Scheduler_close(&pSession->scheduler);
+    pSession->onEnd(pSession, pSession->onEndArg);
+}
+
+// pool task: send up to SESSION_SEND_BUDGET queued items, then leave the
+// rest to a later run so one busy session can't hold a worker. A worker never
+// waits for the remote peer: when the socket is full, the item goes back to
+// the front of the queue and the task runs again once the socket drains.
+static void sendTask(PoolTask* pTask) {
+    Session* pSession = ILIST_CONTAINER_OF(pTask, Session, sendTask);
+
+    for (int i = 0; i < SESSION_SEND_BUDGET; i++) {
+        SchedItem* pItem = Scheduler_tryDequeue(&pSession->scheduler);
+        if (pItem == NULL) {return;}
+
+        int val = pItem->send(pItem);
+        if (val == SCHED_BLOCKED) {
+            Scheduler_requeue(&pSession->scheduler, pItem);
+            if (atomic_load(&pSession->ended)) {return;}
+            if (Pool_watchWritable(pSession->pool, pSession->transport->sendPollFd, pTask) == POOL_FAIL) {
+                Pool_submit(pSession->pool, pTask);
+            }
+            return;
+        }
+        if (val == SCHED_FAIL) {
+            char* failMessage = "Cannot send to remote peer\n";
+            printText(pSession, "", failMessage, strlen(failMessage));
+            endSession(pSession);
+            return;
+        }
+        if (val == SCHED_STOP) {
+            char* endMessage = "Chat terminated\n";
+            printText(pSession, "", endMessage, strlen(endMessage));
+            endSession(pSession);
+            return;
+        }
+    }
+    Pool_submit(pSession->pool, pTask);
+}
+
+// pool task: receive up to SESSION_RECV_BUDGET datagrams, writing chat
+// straight to the screen, then watch the socket again once it is drained
+static void receiveTask(PoolTask* pTask) {
+    Session* pSession = ILIST_CONTAINER_OF(pTask, Session, receiveTask);
+    char buffer[TRANSPORT_RECV_BUFLEN];
+    int segmentSize;
+
+    if (atomic_load(&pSession->ended)) {return;}
+
+    for (int i = 0; i < SESSION_RECV_BUDGET; i++) {
+        int size = Transport_recv(pSession->transport, buffer, TRANSPORT_RECV_BUFLEN, &segmentSize);
+        if (size == -1) {
+            if (errno == EINTR) {continue;}
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // drained: wait for the poller to see the next datagram
+                Pool_rearm(pSession->pool, pSession->transport->pollFd, pTask);
+                return;
+            }
+            char* failMessage = "Cannot receive from remote peer\n";
+            printText(pSession, "", failMessage, strlen(failMessage));
+            endSession(pSession);
+            return;
+        }
+
+        // buffer holds one datagram, or several of segmentSize bytes each
+        // if the kernel coalesced them
+        for (int pos = 0; pos < size; pos += segmentSize) {
+            char* datagram = buffer + pos;
+            int len = (size - pos < segmentSize) ? size - pos : segmentSize;
+
+            // file transfer frames never reach the screen
+            if (Transfer_isFrame(datagram, len)) {
+                Transfer_receive(pSession->transfer, datagram, len);
+                continue;
+            }
+
+            printText(pSession, "Remote: ", datagram, len);
+
+            // if message was a single '!', terminate chat
+            if (len == 2 && !memcmp(datagram, "!\n", 2)) {
+                char* endMessage = "Chat terminated\n";
+                printText(pSession, "", endMessage, strlen(endMessage));
+                endSession(pSession);
+                return;
+            }
+        }
+    }
+
+    // more may be waiting; let other sessions' tasks run first
+    Pool_submit(pSession->pool, pTask);
+}
+
+// scheduler notify hook: something was queued, so have it sent
+static void notifySender(void* arg) {
+    Session* pSession = arg;
+    Pool_submit(pSession->pool, &pSession->sendTask);
+}
+
+int Session_start(Session* pSession, Pool* pPool, SESSION_END_FN onEnd, void* arg) {
+    if (Transport_setNonBlocking(pSession->transport) == TRANSPORT_FAIL) {return SESSION_FAIL;}
+
+    pSession->pool = pPool;
+    pSession->onEnd = onEnd;
+    pSession->onEndArg = arg;
+    PoolTask_init(&pSession->sendTask, sendTask);
+    PoolTask_init(&pSession->receiveTask, receiveTask);
+    Scheduler_setNotify(&pSession->scheduler, notifySender, pSession);
+
+    if (Pool_watch(pPool, pSession->transport->pollFd, &pSession->receiveTask) == POOL_FAIL) {
+        return SESSION_FAIL;
+    }
+    return SESSION_SUCCESS;
+}
+
+void Session_input(Session* pSession, const char* data, int len) {
+    if (atomic_load(&pSession->ended)) {return;}
+    queueLines(pSession, data, len);
+}
+
+bool Session_hasEnded(Session* pSession) {
+    return atomic_load(&pSession->ended);
+}
+
+void Session_close(Session* pSession) {
+    // drop anything left unsent, stop file transfers and close the transport
+    Scheduler_close(&pSession->scheduler);
+    if (Transfer_destroy(pSession->transfer) == TRANSFER_FAIL) {
+        // a transfer thread is stuck with them; leave the session to exit
+        return;
+    }
+    Transport_close(pSession->transport);
+    Scheduler_destroy(&pSession->scheduler);
+
+    // free lists
+    freeMessages(&pSession->recList);
+
+    pthread_mutex_destroy(&pSession->listMutex);
+    pthread_mutex_destroy(&pSession->recMutex);
+    pthread_cond_destroy(&pSession->recCond);
+    free(pSession);
+}
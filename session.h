@@ -0,0 +1,107 @@
+// Chat session
+// A session is one conversation with one remote peer: the transport to it, the
+// scheduler everything sent to it goes through, its file transfers and the
+// messages on their way to the screen. A session either runs on four threads of
+// its own that read the keyboard, send, receive and write to the screen, or
+// shares the workers of a Pool with other sessions. A session on a pool is given
+// the lines typed for it by Session_input, and everything it prints starts with
+// its label.
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "ilist.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "transfer.h"
+#include "transport.h"
+
+#define SESSION_SUCCESS 0
+#define SESSION_FAIL -1
+
+// Longest label Session_open accepts
+#define SESSION_MAX_LABEL TRANSFER_MAX_LABEL
+
+// Datagrams a session on a pool receives, and items it sends, before letting
+// other sessions' tasks run
+#define SESSION_RECV_BUDGET 64
+#define SESSION_SEND_BUDGET 16
+
+enum SessionThread {
+    SESSION_INPUT_THREAD,
+    SESSION_SENDER_THREAD,
+    SESSION_RECEIVER_THREAD,
+    SESSION_OUTPUT_THREAD,
+    SESSION_NUM_THREADS
+};
+
+typedef struct Session_s Session;
+typedef struct Message_s Message;
+
+// Called once when the chat of a session on a pool is terminated from either side.
+typedef void (*SESSION_END_FN)(Session* pSession, void* arg);
+
+struct Session_s {
+    char label[SESSION_MAX_LABEL + 1];
+    Transport* transport;
+    Scheduler scheduler;       // everything waiting to be sent to the remote peer
+    Transfer* transfer;
+    bool midLine;              // the last input typed didn't end its line
+
+    // sessions with threads of their own; in low-latency mode the threads
+    // spin on their queues instead of sleeping, each pinned to its core
+    // (-1 leaves a thread unpinned)
+    pthread_t threads[SESSION_NUM_THREADS];
+    int threadCpus[SESSION_NUM_THREADS];
+    bool lowLatency;
+    IList recList;             // messages received, waiting to be output
+    pthread_mutex_t listMutex;
+    pthread_mutex_t recMutex;
+    pthread_cond_t recCond;
+    Message* messageToRec;
+
+    // sessions on a pool
+    Pool* pool;
+    PoolTask sendTask;
+    PoolTask receiveTask;
+    atomic_bool ended;
+    SESSION_END_FN onEnd;
+    void* onEndArg;
+};
+
+// Opens a session with remotePort on remoteHostname over a transport of the
+// given kind that receives on myPort. Everything the session prints starts
+// with label.
+// Returns NULL on failure.
+Session* Session_open(int transportKind, const char* myPort, const char* remoteHostname,
+                      const char* remotePort, const char* label);
+
+// Makes the threads of Session_run poll instead of sleeping, pinned to the
+// given cores (SESSION_NUM_THREADS of them, -1 for no core).
+void Session_setLowLatency(Session* pSession, const int* threadCpus);
+
+// Runs the session on threads of its own, reading lines from the keyboard,
+// until the chat is terminated from either side.
+void Session_run(Session* pSession);
+
+// Runs the session as tasks on pPool and calls onEnd(pSession, arg) once the
+// chat is terminated. The transport must have a pollFd.
+// Returns 0 on success, -1 on failure.
+int Session_start(Session* pSession, Pool* pPool, SESSION_END_FN onEnd, void* arg);
+
+// Handles len bytes typed for a session on a pool line by line: commands,
+// and chat messages to send.
+void Session_input(Session* pSession, const char* data, int len);
+
+// Returns true once the chat of a session on a pool has been terminated.
+bool Session_hasEnded(Session* pSession);
+
+// Closes the session and frees it. Its threads must have finished, or for a
+// session on a pool, the pool must have been destroyed. If a file transfer
+// thread doesn't stop in time, the session is left allocated for it.
+void Session_close(Session* pSession);
+
+#endif
@@ -0,0 +1,44 @@
+// Spin-waiting helpers
+// Used by threads that poll a queue instead of sleeping on it, trading CPU
+// time for wakeups that don't go through the scheduler.
+
+#ifndef _SPIN_H_
+#define _SPIN_H_
+#include <sched.h>
+
+// Most pause instructions issued between two polls of a queue
+#define SPIN_MAX_PAUSES 64
+
+typedef struct SpinBackoff_s SpinBackoff;
+struct SpinBackoff_s {
+    int pauses;
+};
+
+#define SPIN_BACKOFF_INIT {1}
+
+// Tells the CPU we're in a spin loop so it can save power and let the
+// other hyperthread run.
+static inline void Spin_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Waits a little longer each time it is called while a queue stays empty.
+// Once the wait reaches its bound it also yields the CPU, so a spinning
+// thread sharing a core with the thread it waits on still lets it run.
+static inline void Spin_backoff(SpinBackoff* pBackoff) {
+    for (int i = 0; i < pBackoff->pauses; i++) {
+        Spin_relax();
+    }
+    if (pBackoff->pauses < SPIN_MAX_PAUSES) {
+        pBackoff->pauses *= 2;
+    }
+    else {
+        sched_yield();
+    }
+}
+
+#endif
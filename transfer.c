@@ -0,0 +1,1015 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "transfer.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// first bytes of every transfer datagram; typed text never contains a NUL
+static const char transferMagic[4] = {'\0', 'S', 'T', 'K'};
+
+// how long the sender waits for a reply to an END frame, and how often it asks
+#define TRANSFER_REPLY_TIMEOUT_MS 300
+#define TRANSFER_END_RETRIES 5
+
+// how long Transfer_destroy waits for the transfer thread to let go
+#define TRANSFER_STOP_TIMEOUT_MS 2000
+
+#define TRANSFER_MAX_NAME 255
+
+enum TransferFrameType {
+    TRANSFER_START = 1,  // offset = first byte sent, length = file size, payload = name
+    TRANSFER_DATA,       // offset = file offset, length = chunk length, payload = chunk
+    TRANSFER_END,        // same fields as START, sent after each round of chunks
+    TRANSFER_RESUME,     // reply: offset = first byte the receiver is missing, length = bytes
+                         // it has received, payload = the missing ranges
+    TRANSFER_DONE,       // reply: the whole file arrived
+    TRANSFER_REFUSED     // reply: the receiver won't take the file
+};
+
+// all fields are in network byte order; crc covers the payload
+typedef struct TransferHeader_s TransferHeader;
+struct TransferHeader_s {
+    char magic[4];
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t id;
+    uint32_t crc;
+    uint64_t offset;
+    uint64_t length;
+};
+_Static_assert(sizeof(TransferHeader) == TRANSFER_HEADER_SIZE, "transfer header size");
+
+// a run of missing file data listed in a RESUME reply, in network byte order
+// on the wire
+typedef struct TransferRange_s TransferRange;
+struct TransferRange_s {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// most ranges a RESUME reply carries; it has to fit the smallest datagram any
+// transport takes, so when more runs are missing the rest wait for a later round
+#define TRANSFER_MAX_RANGES ((TRANSPORT_MAX_DATAGRAM - TRANSFER_HEADER_SIZE) / sizeof(TransferRange))
+
+// slowest rate re-sent chunks are paced at, in bytes per second
+#define TRANSFER_MIN_RATE (1 << 20)
+
+typedef struct OutgoingTransfer_s OutgoingTransfer;
+struct OutgoingTransfer_s {
+    Transfer* owner;
+    char path[4096];
+    char name[TRANSFER_MAX_NAME + 1];
+    uint32_t id;
+    uint64_t start;
+    uint64_t size;
+    const char* map;
+    int batchesQueued;  // batches still holding on to map
+};
+
+// a frame copied into a send queue item
+typedef struct QueuedFrame_s QueuedFrame;
+struct QueuedFrame_s {
+    SchedItem item;
+    Transfer* owner;
+    TransferHeader hdr;
+    size_t payloadLen;
+    char payload[];
+};
+
+// up to TRANSFER_BATCH chunks, read from the mapping when their turn comes
+typedef struct QueuedBatch_s QueuedBatch;
+struct QueuedBatch_s {
+    SchedItem item;
+    OutgoingTransfer* t;
+    uint64_t offset;
+    int count;
+    int sent;  // chunks already sent when the transport last had no room
+};
+
+struct Transfer_s {
+    // transport to the remote peer, and the scheduler everything is sent through
+    Transport* transport;
+    Scheduler* scheduler;
+    char label[TRANSFER_MAX_LABEL + 1];
+
+    // set once the kernel refuses a GSO send, after which sendmmsg is used;
+    // only touched by the sender
+    int gsoDisabled;
+
+    // outgoing transfer state, shared between the transfer thread and the
+    // receiving side that delivers replies
+    pthread_mutex_t mutex;
+    pthread_cond_t replyCond;
+    pthread_cond_t drainCond;
+    pthread_cond_t idleCond;
+    int sending;
+    int stopping;
+    uint32_t sendId;
+    int replyType;
+    uint64_t replyReceived;
+    TransferRange replyRanges[TRANSFER_MAX_RANGES];
+    int replyRangeCount;
+
+    // incoming transfer state, only touched by the receiving side
+    uint32_t incomingId;
+    int incomingActive;
+    int incomingComplete;
+    int incomingRefused;            // won't take this id; the user was told once, the sender is told at every END
+    int incomingFd;
+    uint64_t incomingSize;
+    uint64_t incomingReceived;      // bytes written by this transfer
+    unsigned char* incomingChunks;  // bitmap of received chunks, also kept after the data in the .part file
+    char incomingName[TRANSFER_MAX_NAME + 1];
+};
+
+// CRC-32C, using the SSE4.2 instruction where the CPU has it
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+static int crcHardware = 0;
+
+static void initializeCrc() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0x82F63B78 ^ (c >> 1) : c >> 1;
+        }
+        crcTable[i] = c;
+    }
+#if defined(__x86_64__)
+    crcHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        c = __builtin_ia32_crc32qi((uint32_t) c, *p++);
+    }
+    return (uint32_t) c;
+}
+#endif
+
+static uint32_t crc32c(const void* data, size_t len) {
+    pthread_once(&crcOnce, initializeCrc);
+
+    const unsigned char* p = data;
+    uint32_t crc = 0xFFFFFFFF;
+#if defined(__x86_64__)
+    if (crcHardware) {return ~crc32cHardware(crc, p, len);}
+#endif
+    while (len-- > 0) {
+        crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void printStatus(Transfer* pTransfer, const char* fmt, ...) {
+    char line[512];
+    int labelLen = strlen(pTransfer->label);
+    memcpy(line, pTransfer->label, labelLen);
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line + labelLen, sizeof(line) - labelLen, fmt, args);
+    va_end(args);
+    if (len < 0) {return;}
+    len += labelLen;
+    if (len >= (int) sizeof(line)) {len = sizeof(line) - 1;}
+    write(1, line, len);
+}
+
+static void fillHeader(TransferHeader* hdr, int type, uint32_t id, uint64_t offset, uint64_t length,
+                       const void* payload, size_t payloadLen) {
+    memcpy(hdr->magic, transferMagic, sizeof(transferMagic));
+    hdr->type = type;
+    memset(hdr->pad, 0, sizeof(hdr->pad));
+    hdr->id = htonl(id);
+    hdr->crc = htonl(payloadLen > 0 ? crc32c(payload, payloadLen) : 0);
+    hdr->offset = htobe64(offset);
+    hdr->length = htobe64(length);
+}
+
+// Transfer items report success to the sender thread even when the transport
+// fails: lost frames are recovered by the END/RESUME exchange, and a broken
+// transfer must not end the chat. Only a transport with no room makes them
+// report SCHED_BLOCKED, to be sent again once it drains.
+
+static int sendQueuedFrame(SchedItem* pItem) {
+    QueuedFrame* frame = ILIST_CONTAINER_OF(pItem, QueuedFrame, item);
+    struct iovec iov[2] = {
+        {.iov_base = &frame->hdr, .iov_len = sizeof(frame->hdr)},
+        {.iov_base = frame->payload, .iov_len = frame->payloadLen}
+    };
+    int val = Transport_sendv(frame->owner->transport, iov, frame->payloadLen > 0 ? 2 : 1);
+    if (val == TRANSPORT_WOULD_BLOCK) {return SCHED_BLOCKED;}
+
+    free(frame);
+    return SCHED_SENT;
+}
+
+static void discardQueuedFrame(SchedItem* pItem) {
+    free(ILIST_CONTAINER_OF(pItem, QueuedFrame, item));
+}
+
+// queue a frame made of a header and an optional payload
+static int queueFrame(Transfer* pTransfer, int trafficClass, TransferHeader* hdr, const void* payload, size_t payloadLen) {
+    QueuedFrame* frame = (QueuedFrame*) malloc(sizeof(QueuedFrame) + payloadLen);
+    if (frame == NULL) {return TRANSFER_FAIL;}
+
+    frame->owner = pTransfer;
+    frame->hdr = *hdr;
+    frame->payloadLen = payloadLen;
+    if (payloadLen > 0) {memcpy(frame->payload, payload, payloadLen);}
+    frame->item.send = sendQueuedFrame;
+    frame->item.discard = discardQueuedFrame;
+
+    Scheduler_enqueue(pTransfer->scheduler, &frame->item, trafficClass, sizeof(TransferHeader) + payloadLen);
+    return TRANSFER_SUCCESS;
+}
+
+Transfer* Transfer_create(Transport* pTransport, Scheduler* pScheduler, const char* label) {
+    Transfer* pTransfer = (Transfer*) calloc(1, sizeof(Transfer));
+    if (pTransfer == NULL || strlen(label) > TRANSFER_MAX_LABEL) {
+        free(pTransfer);
+        return NULL;
+    }
+
+    pTransfer->transport = pTransport;
+    pTransfer->scheduler = pScheduler;
+    strcpy(pTransfer->label, label);
+    pthread_mutex_init(&pTransfer->mutex, NULL);
+    pthread_cond_init(&pTransfer->replyCond, NULL);
+    pthread_cond_init(&pTransfer->drainCond, NULL);
+    pthread_cond_init(&pTransfer->idleCond, NULL);
+    pTransfer->incomingFd = -1;
+
+    // start ids somewhere new each run so a restarted sender isn't mistaken
+    // for the transfer the receiver already completed; the address keeps
+    // sessions of one process apart
+    pTransfer->sendId = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16) ^ (uint32_t) (uintptr_t) pTransfer;
+
+    // probe for GSO support up front so the first batch doesn't have to fail
+    int gsoSize = 0;
+    socklen_t optLen = sizeof(gsoSize);
+    if (pTransport->sockfdBatch == -1 ||
+        getsockopt(pTransport->sockfdBatch, SOL_UDP, UDP_SEGMENT, &gsoSize, &optLen) == -1) {
+        pTransfer->gsoDisabled = 1;
+    }
+
+    return pTransfer;
+}
+
+// build the headers and iovecs for up to maxCount chunks starting at offset,
+// returning the number of chunks
+static int prepareBatch(OutgoingTransfer* t, uint64_t offset, int maxCount, TransferHeader* hdrs, struct iovec* iov) {
+    int count = 0;
+    while (count < maxCount && offset < t->size) {
+        uint64_t len = t->size - offset;
+        if (len > TRANSFER_CHUNK_SIZE) {len = TRANSFER_CHUNK_SIZE;}
+
+        const char* chunk = t->map + offset;
+        fillHeader(&hdrs[count], TRANSFER_DATA, t->id, offset, len, chunk, len);
+
+        // the chunk is sent straight from the mapping; only the header is copied
+        iov[2 * count].iov_base = &hdrs[count];
+        iov[2 * count].iov_len = sizeof(TransferHeader);
+        iov[2 * count + 1].iov_base = (void*) chunk;
+        iov[2 * count + 1].iov_len = len;
+
+        offset += len;
+        count++;
+    }
+    return count;
+}
+
+// send one batch as a single GSO super-datagram that the kernel splits into
+// TRANSFER_SEGMENT_SIZE datagrams. A peer that isn't listening refuses the
+// batch the way it would drop any datagram.
+// Returns the number of chunks sent, which is 0 if a non-blocking socket had
+// no room, or -1 with errno set if the send failed.
+static int sendBatchGso(Transport* pTransport, struct iovec* iov, int count) {
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2 * count;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segmentSize = TRANSFER_SEGMENT_SIZE;
+    memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+
+    while (sendmsg(pTransport->sockfdBatch, &msg, 0) == -1) {
+        if (errno == ECONNREFUSED) {return count;}
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {return 0;}
+        if (errno == ENOBUFS || errno == EINTR) {
+            sched_yield();
+            continue;
+        }
+        return -1;
+    }
+    return count;
+}
+
+// send one batch as individual datagrams with as few system calls as possible.
+// Returns the number of chunks sent, which is less than count if a
+// non-blocking socket ran out of room, or -1 with errno set if the send failed.
+static int sendBatchMmsg(Transport* pTransport, struct iovec* iov, int count) {
+    struct mmsghdr msgs[TRANSFER_BATCH];
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (int i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[2 * i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    int sent = 0;
+    while (sent < count) {
+        int val = sendmmsg(pTransport->sockfdBatch, msgs + sent, count - sent, 0);
+        if (val == -1) {
+            if (errno == ECONNREFUSED) {return count;}
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {return sent;}
+            if (errno == ENOBUFS || errno == EINTR) {
+                sched_yield();
+                continue;
+            }
+            return -1;
+        }
+        sent += val;
+    }
+    return sent;
+}
+
+// send the chunks of a batch that haven't been sent yet. A transport with no
+// room leaves the rest for the next try.
+// Returns SCHED_SENT, or SCHED_BLOCKED if chunks are left.
+static int sendBatch(QueuedBatch* batch) {
+    OutgoingTransfer* t = batch->t;
+    TransferHeader hdrs[TRANSFER_BATCH];
+    struct iovec iov[2 * TRANSFER_BATCH];
+    uint64_t offset = batch->offset + (uint64_t) batch->sent * TRANSFER_CHUNK_SIZE;
+    int count = prepareBatch(t, offset, batch->count - batch->sent, hdrs, iov);
+    Transfer* pTransfer = t->owner;
+    Transport* pTransport = pTransfer->transport;
+    int sent = -1;
+
+    if (pTransport->sockfdBatch == -1) {
+        // transports without a socket take one datagram at a time
+        for (sent = 0; sent < count; sent++) {
+            int val = Transport_sendv(pTransport, &iov[2 * sent], 2);
+            if (val == TRANSPORT_WOULD_BLOCK) {break;}
+            if (val == TRANSPORT_FAIL) {return SCHED_SENT;}
+        }
+    }
+    else {
+        if (!pTransfer->gsoDisabled) {
+            sent = sendBatchGso(pTransport, iov, count);
+            // fall back for good only if the kernel or device can't segment;
+            // any other failure loses the batch, which a later round re-sends
+            if (sent == -1 && errno != EINVAL && errno != EIO && errno != ENOPROTOOPT) {return SCHED_SENT;}
+            if (sent == -1) {pTransfer->gsoDisabled = 1;}
+        }
+        if (sent == -1) {sent = sendBatchMmsg(pTransport, iov, count);}
+        if (sent == -1) {return SCHED_SENT;}
+    }
+
+    if (sent < count) {
+        batch->sent += sent;
+        return SCHED_BLOCKED;
+    }
+    return SCHED_SENT;
+}
+
+static void finishBatch(OutgoingTransfer* t) {
+    pthread_mutex_lock(&t->owner->mutex);
+    t->batchesQueued--;
+    if (t->batchesQueued == 0) {pthread_cond_broadcast(&t->owner->drainCond);}
+    pthread_mutex_unlock(&t->owner->mutex);
+}
+
+static int sendQueuedBatch(SchedItem* pItem) {
+    QueuedBatch* batch = ILIST_CONTAINER_OF(pItem, QueuedBatch, item);
+    if (sendBatch(batch) == SCHED_BLOCKED) {return SCHED_BLOCKED;}
+
+    finishBatch(batch->t);
+    free(batch);
+    return SCHED_SENT;
+}
+
+static void discardQueuedBatch(SchedItem* pItem) {
+    QueuedBatch* batch = ILIST_CONTAINER_OF(pItem, QueuedBatch, item);
+    finishBatch(batch->t);
+    free(batch);
+}
+
+// queue the chunks from offset up to end as bulk traffic, blocking while the
+// bulk queue is full. With a rate, batches are queued no faster than rate
+// bytes per second.
+static int queueChunks(OutgoingTransfer* t, uint64_t offset, uint64_t end, uint64_t rate) {
+    const uint64_t batchLen = (uint64_t) TRANSFER_BATCH * TRANSFER_CHUNK_SIZE;
+    Transfer* pTransfer = t->owner;
+    struct timespec paceStart;
+    uint64_t queued = 0;
+    clock_gettime(CLOCK_MONOTONIC, &paceStart);
+
+    while (offset < end) {
+        QueuedBatch* batch = (QueuedBatch*) malloc(sizeof(QueuedBatch));
+        if (batch == NULL) {return TRANSFER_FAIL;}
+
+        uint64_t len = (end - offset > batchLen) ? batchLen : end - offset;
+        uint64_t chunks = (len + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+
+        batch->t = t;
+        batch->offset = offset;
+        batch->count = chunks;
+        batch->sent = 0;
+        batch->item.send = sendQueuedBatch;
+        batch->item.discard = discardQueuedBatch;
+
+        // wait for this batch's turn
+        if (rate > 0) {
+            uint64_t dueNs = queued * 1000000000ULL / rate + paceStart.tv_nsec;
+            struct timespec due = {paceStart.tv_sec + dueNs / 1000000000ULL, dueNs % 1000000000ULL};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {}
+        }
+
+        pthread_mutex_lock(&pTransfer->mutex);
+        int stopping = pTransfer->stopping;
+        if (!stopping) {t->batchesQueued++;}
+        pthread_mutex_unlock(&pTransfer->mutex);
+
+        if (stopping) {
+            free(batch);
+            return TRANSFER_FAIL;
+        }
+
+        Scheduler_enqueue(pTransfer->scheduler, &batch->item, TRAFFIC_BULK, len + chunks * TRANSFER_HEADER_SIZE);
+        offset += len;
+        queued += len;
+    }
+    return TRANSFER_SUCCESS;
+}
+
+// wait until no queued batch reads from t's mapping any more
+static void waitForBatches(OutgoingTransfer* t) {
+    pthread_mutex_lock(&t->owner->mutex);
+    while (t->batchesQueued > 0) {
+        pthread_cond_wait(&t->owner->drainCond, &t->owner->mutex);
+    }
+    pthread_mutex_unlock(&t->owner->mutex);
+}
+
+// START and END travel with the file data so END never overtakes a chunk
+static int sendControl(OutgoingTransfer* t, int type) {
+    TransferHeader hdr;
+    size_t nameLen = strlen(t->name);
+    fillHeader(&hdr, type, t->id, t->start, t->size, t->name, nameLen);
+    return queueFrame(t->owner, TRAFFIC_BULK, &hdr, t->name, nameLen);
+}
+
+// send END and wait for the receiver to report what it's missing: the ranges
+// of a RESUME go to ranges and their number to *pRangeCount, and the bytes the
+// receiver has taken so far to *pReceived.
+// Returns the reply type, or 0 if the receiver never answered.
+static int awaitReply(OutgoingTransfer* t, TransferRange* ranges, int* pRangeCount, uint64_t* pReceived) {
+    Transfer* pTransfer = t->owner;
+
+    for (int attempt = 0; attempt < TRANSFER_END_RETRIES; attempt++) {
+        pthread_mutex_lock(&pTransfer->mutex);
+        pTransfer->replyType = 0;
+        pthread_mutex_unlock(&pTransfer->mutex);
+
+        if (sendControl(t, TRANSFER_END) == TRANSFER_FAIL) {return 0;}
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRANSFER_REPLY_TIMEOUT_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&pTransfer->mutex);
+        int val = 0;
+        while (pTransfer->replyType == 0 && !pTransfer->stopping && val != ETIMEDOUT) {
+            val = pthread_cond_timedwait(&pTransfer->replyCond, &pTransfer->mutex, &deadline);
+        }
+        int type = pTransfer->replyType;
+        int stopping = pTransfer->stopping;
+        *pRangeCount = pTransfer->replyRangeCount;
+        memcpy(ranges, pTransfer->replyRanges, *pRangeCount * sizeof(TransferRange));
+        *pReceived = pTransfer->replyReceived;
+        pthread_mutex_unlock(&pTransfer->mutex);
+
+        if (type != 0 || stopping) {return type;}
+    }
+    return 0;
+}
+
+// returns true if the ranges of a RESUME reply are in order, chunk aligned and
+// within a file of size bytes
+static bool validRanges(const TransferRange* ranges, int count, uint64_t size) {
+    uint64_t end = 0;
+    for (int i = 0; i < count; i++) {
+        if (ranges[i].offset < end || ranges[i].offset % TRANSFER_CHUNK_SIZE != 0 ||
+            ranges[i].offset >= size || ranges[i].length == 0 || ranges[i].length > size - ranges[i].offset) {
+            return false;
+        }
+        end = ranges[i].offset + ranges[i].length;
+    }
+    return count > 0;
+}
+
+static void* sendFileLoop(void* args) {
+    OutgoingTransfer* t = args;
+    Transfer* pTransfer = t->owner;
+    struct timespec startTime, endTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    // the first round sends everything from start at full speed; later ones
+    // send only what the receiver is missing, no faster than it took data
+    TransferRange ranges[TRANSFER_MAX_RANGES] = {{t->start, t->size - t->start}};
+    int rangeCount = 1;
+    uint64_t rate = 0;
+    uint64_t received = 0;
+
+    uint64_t offset = t->start;
+    uint64_t firstSent = t->start;  // the receiver may ask for data before start
+    uint64_t bytesSent = 0;
+    int type = -1;                  // last reply, 0 if none came
+    int answered = 0;
+    int stalled = 0;                // rounds in a row that got nothing across
+
+    if (sendControl(t, TRANSFER_START) == TRANSFER_SUCCESS) {
+        while (stalled < TRANSFER_MAX_ROUNDS) {
+            struct timespec roundStart, roundEnd;
+            clock_gettime(CLOCK_MONOTONIC, &roundStart);
+
+            int queued = TRANSFER_SUCCESS;
+            for (int i = 0; i < rangeCount && queued == TRANSFER_SUCCESS; i++) {
+                queued = queueChunks(t, ranges[i].offset, ranges[i].offset + ranges[i].length, rate);
+                bytesSent += ranges[i].length;
+            }
+            if (queued == TRANSFER_FAIL) {break;}
+
+            uint64_t lastReceived = received;
+            type = awaitReply(t, ranges, &rangeCount, &received);
+            if (type != 0) {answered = 1;}
+            if (type != TRANSFER_RESUME || !validRanges(ranges, rangeCount, t->size)) {break;}
+
+            // the receiver lost chunks; go back for just those
+            offset = ranges[0].offset;
+            if (offset < firstSent) {firstSent = offset;}
+            stalled = (received != lastReceived) ? 0 : stalled + 1;
+
+            clock_gettime(CLOCK_MONOTONIC, &roundEnd);
+            double seconds = (roundEnd.tv_sec - roundStart.tv_sec) + (roundEnd.tv_nsec - roundStart.tv_nsec) / 1e9;
+            rate = (received > lastReceived && seconds > 0) ? (received - lastReceived) / seconds : 0;
+            if (rate < TRANSFER_MIN_RATE) {rate = TRANSFER_MIN_RATE;}
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    if (seconds <= 0) {seconds = 1e-9;}
+
+    pthread_mutex_lock(&pTransfer->mutex);
+    int stopping = pTransfer->stopping;
+    pthread_mutex_unlock(&pTransfer->mutex);
+
+    if (type == TRANSFER_DONE) {
+        printStatus(pTransfer, "Sent %s: %llu bytes in %.3f s (%.1f Mbit/s)\n", t->name,
+                    (unsigned long long) (t->size - firstSent), seconds, bytesSent * 8 / seconds / 1e6);
+    }
+    else if (type == TRANSFER_REFUSED) {
+        printStatus(pTransfer, "The remote peer refused %s\n", t->name);
+    }
+    else if (!answered && !stopping) {
+        // nothing to resume: the peer may not be there, or can't take files
+        printStatus(pTransfer, "No reply from the remote peer; %s was not sent\n", t->name);
+    }
+    else {
+        printStatus(pTransfer, "Transfer of %s interrupted at byte %llu; resume with /send %s %llu\n",
+                    t->name, (unsigned long long) offset, t->path, (unsigned long long) offset);
+    }
+
+    waitForBatches(t);
+    if (t->map != NULL) {munmap((void*) t->map, t->size);}
+    free(t);
+
+    // pTransfer may be destroyed as soon as sending is cleared
+    pthread_mutex_lock(&pTransfer->mutex);
+    pTransfer->sending = 0;
+    pthread_cond_broadcast(&pTransfer->idleCond);
+    pthread_mutex_unlock(&pTransfer->mutex);
+    return NULL;
+}
+
+static int startSending(Transfer* pTransfer, const char* path, long long offset) {
+    if (offset < 0) {
+        printStatus(pTransfer, "Cannot send %s from offset %lld\n", path, offset);
+        return TRANSFER_FAIL;
+    }
+
+    pthread_mutex_lock(&pTransfer->mutex);
+    if (pTransfer->sending || pTransfer->stopping) {
+        pthread_mutex_unlock(&pTransfer->mutex);
+        printStatus(pTransfer, "A file transfer is already in progress\n");
+        return TRANSFER_FAIL;
+    }
+    pTransfer->sending = 1;
+    pTransfer->sendId++;
+    uint32_t id = pTransfer->sendId;
+    pthread_mutex_unlock(&pTransfer->mutex);
+
+    OutgoingTransfer* t = (OutgoingTransfer*) calloc(1, sizeof(OutgoingTransfer));
+    int fd = -1;
+    struct stat st;
+    if (t == NULL || strlen(path) >= sizeof(t->path)) {goto fail;}
+
+    t->owner = pTransfer;
+    strcpy(t->path, path);
+    const char* name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    if (name[0] == '\0' || strlen(name) > TRANSFER_MAX_NAME) {goto fail;}
+    strcpy(t->name, name);
+
+    // check the type before opening, as opening a FIFO or a device could
+    // block; O_NONBLOCK covers the path being swapped in between
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {goto fail;}
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        (uint64_t) st.st_size > TRANSFER_MAX_FILE_SIZE) {goto fail;}
+
+    t->id = id;
+    t->size = st.st_size;
+    t->start = (uint64_t) offset;
+    if (t->start > t->size) {t->start = t->size;}
+    t->start -= t->start % TRANSFER_CHUNK_SIZE;
+
+    if (t->size > 0) {
+        void* map = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {goto fail;}
+        madvise(map, t->size, MADV_SEQUENTIAL);
+        t->map = map;
+    }
+    close(fd);
+    fd = -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sendFileLoop, t) != 0) {goto fail;}
+    pthread_detach(thread);
+
+    printStatus(pTransfer, "Sending %s (%llu bytes)\n", t->name, (unsigned long long) t->size);
+    return TRANSFER_SUCCESS;
+
+fail:
+    printStatus(pTransfer, "Cannot send %s\n", path);
+    if (fd != -1) {close(fd);}
+    if (t != NULL && t->map != NULL) {munmap((void*) t->map, t->size);}
+    free(t);
+
+    pthread_mutex_lock(&pTransfer->mutex);
+    pTransfer->sending = 0;
+    pthread_cond_broadcast(&pTransfer->idleCond);
+    pthread_mutex_unlock(&pTransfer->mutex);
+    return TRANSFER_FAIL;
+}
+
+// The threads calling Transfer_send and Transfer_receive are cancelled when the
+// chat ends. Cancelling them halfway could leave sending set for good, so they
+// run with cancellation disabled; neither waits on anything unbounded.
+
+int Transfer_send(Transfer* pTransfer, const char* path, long long offset) {
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    int val = startSending(pTransfer, path, offset);
+    pthread_setcancelstate(oldState, NULL);
+    return val;
+}
+
+bool Transfer_isFrame(const char* datagram, int size) {
+    return size >= TRANSFER_HEADER_SIZE && memcmp(datagram, transferMagic, sizeof(transferMagic)) == 0;
+}
+
+static uint64_t chunkCount(uint64_t size) {
+    return (size + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+}
+
+static uint64_t bitmapSize(uint64_t size) {
+    return chunkCount(size) / 8 + 1;
+}
+
+// write the chunk bitmap after the file data so an interrupted transfer can
+// be resumed from what this side actually has
+static void saveChunks(Transfer* pTransfer) {
+    uint64_t len = bitmapSize(pTransfer->incomingSize);
+    pwrite(pTransfer->incomingFd, pTransfer->incomingChunks, len, pTransfer->incomingSize);
+}
+
+static void closeIncoming(Transfer* pTransfer) {
+    if (pTransfer->incomingActive) {saveChunks(pTransfer);}
+    if (pTransfer->incomingFd != -1) {close(pTransfer->incomingFd);}
+    free(pTransfer->incomingChunks);
+    pTransfer->incomingFd = -1;
+    pTransfer->incomingChunks = NULL;
+    pTransfer->incomingActive = 0;
+}
+
+static void sendReply(Transfer* pTransfer, int type, uint64_t offset, uint64_t length,
+                      const void* payload, size_t payloadLen) {
+    TransferHeader hdr;
+    fillHeader(&hdr, type, pTransfer->incomingId, offset, length, payload, payloadLen);
+    queueFrame(pTransfer, TRAFFIC_CONTROL, &hdr, payload, payloadLen);
+}
+
+static bool hasChunk(Transfer* pTransfer, uint64_t chunk) {
+    return pTransfer->incomingChunks[chunk / 8] & (1 << (chunk % 8));
+}
+
+// list the first TRANSFER_MAX_RANGES runs of missing chunks in ranges, in
+// network byte order.
+// Returns the number of ranges.
+static int missingRanges(Transfer* pTransfer, TransferRange* ranges) {
+    uint64_t size = pTransfer->incomingSize;
+    uint64_t chunks = chunkCount(size);
+    int count = 0;
+
+    for (uint64_t i = 0; i < chunks && count < (int) TRANSFER_MAX_RANGES; ) {
+        if (hasChunk(pTransfer, i)) {
+            i++;
+            continue;
+        }
+        uint64_t first = i;
+        while (i < chunks && !hasChunk(pTransfer, i)) {i++;}
+
+        uint64_t end = i * TRANSFER_CHUNK_SIZE;
+        if (end > size) {end = size;}
+        ranges[count].offset = htobe64(first * TRANSFER_CHUNK_SIZE);
+        ranges[count].length = htobe64(end - first * TRANSFER_CHUNK_SIZE);
+        count++;
+    }
+    return count;
+}
+
+// open name.part for a file of size bytes: either the partial file an earlier
+// transfer of it left, with its chunk bitmap, or a new one. Anything else of
+// that name is left alone.
+// Returns the descriptor, or -1 on failure.
+static int openPartial(Transfer* pTransfer, const char* partName, uint64_t size) {
+    uint64_t mapLen = bitmapSize(size);
+    struct stat st;
+
+    int fd = open(partName, O_RDWR | O_NOFOLLOW);
+    if (fd != -1) {
+        // a partial file of ours has exactly the data and the bitmap
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (uint64_t) st.st_size != size + mapLen ||
+            pread(fd, pTransfer->incomingChunks, mapLen, size) != (ssize_t) mapLen) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    if (errno != ENOENT) {return -1;}
+
+    fd = open(partName, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (fd == -1) {return -1;}
+    if (ftruncate(fd, size + mapLen) == -1) {
+        close(fd);
+        unlink(partName);
+        return -1;
+    }
+    return fd;
+}
+
+// start receiving the file described by a START or END frame
+static void openIncoming(Transfer* pTransfer, uint32_t id, uint64_t size, const char* name, size_t nameLen) {
+    closeIncoming(pTransfer);
+    if (id != pTransfer->incomingId) {pTransfer->incomingRefused = 0;}
+    pTransfer->incomingId = id;
+    pTransfer->incomingComplete = 0;
+    if (pTransfer->incomingRefused) {return;}
+
+    // refuse every frame of this transfer unless it turns out to be acceptable
+    pTransfer->incomingRefused = 1;
+
+    // keep only the last path component so the peer can't write elsewhere
+    if (nameLen == 0 || nameLen > TRANSFER_MAX_NAME || memchr(name, '/', nameLen) != NULL ||
+        memchr(name, '\0', nameLen) != NULL) {return;}
+    memcpy(pTransfer->incomingName, name, nameLen);
+    pTransfer->incomingName[nameLen] = '\0';
+    if (!strcmp(pTransfer->incomingName, ".") || !strcmp(pTransfer->incomingName, "..")) {return;}
+
+    // never replace a file that is already there
+    struct stat st;
+    if (size > TRANSFER_MAX_FILE_SIZE || lstat(pTransfer->incomingName, &st) == 0) {
+        printStatus(pTransfer, "Refusing %s (%llu bytes)\n", pTransfer->incomingName, (unsigned long long) size);
+        return;
+    }
+
+    pTransfer->incomingChunks = (unsigned char*) calloc(bitmapSize(size), 1);
+    if (pTransfer->incomingChunks == NULL) {return;}
+
+    char partName[TRANSFER_MAX_NAME + 8];
+    snprintf(partName, sizeof(partName), "%s.part", pTransfer->incomingName);
+    pTransfer->incomingFd = openPartial(pTransfer, partName, size);
+    if (pTransfer->incomingFd == -1) {
+        printStatus(pTransfer, "Cannot receive %s into %s\n", pTransfer->incomingName, partName);
+        closeIncoming(pTransfer);
+        return;
+    }
+
+    pTransfer->incomingRefused = 0;
+    pTransfer->incomingSize = size;
+    pTransfer->incomingReceived = 0;
+    pTransfer->incomingActive = 1;
+
+    printStatus(pTransfer, "Receiving %s (%llu bytes)\n", pTransfer->incomingName, (unsigned long long) size);
+}
+
+static void receiveChunk(Transfer* pTransfer, uint64_t offset, const char* data, uint64_t len, uint32_t crc) {
+    if (offset % TRANSFER_CHUNK_SIZE != 0 || offset >= pTransfer->incomingSize) {return;}
+
+    uint64_t expected = pTransfer->incomingSize - offset;
+    if (expected > TRANSFER_CHUNK_SIZE) {expected = TRANSFER_CHUNK_SIZE;}
+    if (len != expected) {return;}
+
+    uint64_t chunk = offset / TRANSFER_CHUNK_SIZE;
+    if (pTransfer->incomingChunks[chunk / 8] & (1 << (chunk % 8))) {return;}  // duplicate
+
+    // a corrupted chunk is dropped and requested again at the end of the round
+    if (crc32c(data, len) != crc) {return;}
+    if (pwrite(pTransfer->incomingFd, data, len, offset) != (ssize_t) len) {return;}
+
+    pTransfer->incomingChunks[chunk / 8] |= 1 << (chunk % 8);
+    pTransfer->incomingReceived += len;
+}
+
+static void finishRound(Transfer* pTransfer) {
+    if (pTransfer->incomingComplete) {
+        // the sender missed our DONE
+        sendReply(pTransfer, TRANSFER_DONE, pTransfer->incomingSize, 0, NULL, 0);
+        return;
+    }
+    // tell the sender to give up on a file this side won't take
+    if (!pTransfer->incomingActive) {
+        if (pTransfer->incomingRefused) {sendReply(pTransfer, TRANSFER_REFUSED, 0, 0, NULL, 0);}
+        return;
+    }
+
+    TransferRange ranges[TRANSFER_MAX_RANGES];
+    int count = missingRanges(pTransfer, ranges);
+    if (count > 0) {
+        // keep the bitmap on disk current in case this side stops
+        saveChunks(pTransfer);
+        sendReply(pTransfer, TRANSFER_RESUME, be64toh(ranges[0].offset), pTransfer->incomingReceived,
+                  ranges, count * sizeof(TransferRange));
+        return;
+    }
+
+    // drop the bitmap and move the file into place, unless something took
+    // its name meanwhile
+    char partName[TRANSFER_MAX_NAME + 8];
+    snprintf(partName, sizeof(partName), "%s.part", pTransfer->incomingName);
+    int truncated = ftruncate(pTransfer->incomingFd, pTransfer->incomingSize);
+    pTransfer->incomingActive = 0;
+    closeIncoming(pTransfer);
+    if (truncated == -1 || renameat2(AT_FDCWD, partName, AT_FDCWD, pTransfer->incomingName, RENAME_NOREPLACE) == -1) {
+        printStatus(pTransfer, "Received %s but cannot put it in place; it is in %s\n", pTransfer->incomingName, partName);
+    }
+    else {
+        printStatus(pTransfer, "Received %s (%llu bytes)\n", pTransfer->incomingName, (unsigned long long) pTransfer->incomingReceived);
+    }
+    pTransfer->incomingComplete = 1;
+    sendReply(pTransfer, TRANSFER_DONE, pTransfer->incomingSize, 0, NULL, 0);
+}
+
+static void receiveFrame(Transfer* pTransfer, const char* datagram, int size) {
+    TransferHeader hdr;
+    memcpy(&hdr, datagram, sizeof(hdr));
+
+    uint32_t id = ntohl(hdr.id);
+    uint32_t crc = ntohl(hdr.crc);
+    uint64_t offset = be64toh(hdr.offset);
+    uint64_t length = be64toh(hdr.length);
+    const char* payload = datagram + sizeof(hdr);
+    size_t payloadLen = size - sizeof(hdr);
+
+    switch (hdr.type) {
+        case TRANSFER_START:
+        case TRANSFER_END:
+            if (crc32c(payload, payloadLen) != crc) {return;}
+            // a lost START is recovered from the END that closes the round
+            if (id != pTransfer->incomingId || (!pTransfer->incomingActive && !pTransfer->incomingComplete)) {
+                openIncoming(pTransfer, id, length, payload, payloadLen);
+            }
+            if (hdr.type == TRANSFER_END) {finishRound(pTransfer);}
+            break;
+        case TRANSFER_DATA:
+            if (!pTransfer->incomingActive || id != pTransfer->incomingId || length != payloadLen) {return;}
+            receiveChunk(pTransfer, offset, payload, length, crc);
+            break;
+        case TRANSFER_RESUME:
+        case TRANSFER_DONE:
+        case TRANSFER_REFUSED:
+            if (payloadLen > 0 && crc32c(payload, payloadLen) != crc) {return;}
+            if (payloadLen % sizeof(TransferRange) != 0 || payloadLen / sizeof(TransferRange) > TRANSFER_MAX_RANGES) {return;}
+
+            pthread_mutex_lock(&pTransfer->mutex);
+            if (pTransfer->sending && id == pTransfer->sendId) {
+                pTransfer->replyType = hdr.type;
+                pTransfer->replyReceived = length;
+                pTransfer->replyRangeCount = payloadLen / sizeof(TransferRange);
+                for (int i = 0; i < pTransfer->replyRangeCount; i++) {
+                    TransferRange range;
+                    memcpy(&range, payload + i * sizeof(range), sizeof(range));
+                    pTransfer->replyRanges[i].offset = be64toh(range.offset);
+                    pTransfer->replyRanges[i].length = be64toh(range.length);
+                }
+                pthread_cond_signal(&pTransfer->replyCond);
+            }
+            pthread_mutex_unlock(&pTransfer->mutex);
+            break;
+        default:
+            break;
+    }
+}
+
+void Transfer_receive(Transfer* pTransfer, const char* datagram, int size) {
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    receiveFrame(pTransfer, datagram, size);
+    pthread_setcancelstate(oldState, NULL);
+}
+
+int Transfer_destroy(Transfer* pTransfer) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TRANSFER_STOP_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (TRANSFER_STOP_TIMEOUT_MS % 1000) * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    // stop the outgoing transfer and wait for its thread to let go, but not
+    // forever: a thread stuck on a batch that never finishes keeps pTransfer
+    pthread_mutex_lock(&pTransfer->mutex);
+    pTransfer->stopping = 1;
+    pthread_cond_broadcast(&pTransfer->replyCond);
+    int val = 0;
+    while (pTransfer->sending && val != ETIMEDOUT) {
+        val = pthread_cond_timedwait(&pTransfer->idleCond, &pTransfer->mutex, &deadline);
+    }
+    int sending = pTransfer->sending;
+    pthread_mutex_unlock(&pTransfer->mutex);
+
+    if (sending) {
+        printStatus(pTransfer, "The file transfer did not stop\n");
+        return TRANSFER_FAIL;
+    }
+
+    closeIncoming(pTransfer);
+
+    pthread_mutex_destroy(&pTransfer->mutex);
+    pthread_cond_destroy(&pTransfer->replyCond);
+    pthread_cond_destroy(&pTransfer->drainCond);
+    pthread_cond_destroy(&pTransfer->idleCond);
+    free(pTransfer);
+    return TRANSFER_SUCCESS;
+}
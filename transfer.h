@@ -0,0 +1,75 @@
+// File transfer over the s-talk channel
+// A file is mmapped and sent to the remote peer as checksummed chunks. Over UDP
+// they are batched into GSO sends when the kernel supports them and into
+// sendmmsg otherwise; other transports take them one datagram at a time.
+// Transfer datagrams share the transport with chat messages and are told apart
+// by a header that typed text can never start with. Everything is queued on the
+// send scheduler: file data and its START/END frames as bulk traffic, replies
+// to the sender as control traffic.
+
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "scheduler.h"
+#include "transport.h"
+
+#define TRANSFER_SUCCESS 0
+#define TRANSFER_FAIL -1
+
+// Size of the header in front of every transfer datagram
+#define TRANSFER_HEADER_SIZE 32
+
+// Size of one transfer datagram on the wire (header + chunk data)
+#define TRANSFER_SEGMENT_SIZE 1472
+
+// Bytes of file data carried by one datagram
+#define TRANSFER_CHUNK_SIZE (TRANSFER_SEGMENT_SIZE - TRANSFER_HEADER_SIZE)
+
+// Number of datagrams handed to the kernel by a single GSO send or sendmmsg call
+#define TRANSFER_BATCH 44
+
+// Number of rounds of re-sending missing chunks in a row that bring the
+// receiver nothing new before the sender gives up
+#define TRANSFER_MAX_ROUNDS 64
+
+// Largest file sent or accepted; bounds what a peer can make the receiver
+// allocate and write
+#define TRANSFER_MAX_FILE_SIZE (64ULL << 30)
+
+// Longest label Transfer_create accepts
+#define TRANSFER_MAX_LABEL 31
+
+// File transfers to and from one remote peer
+typedef struct Transfer_s Transfer;
+
+// Sends files and transfer replies to the remote peer over pTransport, queuing
+// every frame on pScheduler for the sender. Status messages start with label.
+// Returns NULL on failure.
+Transfer* Transfer_create(Transport* pTransport, Scheduler* pScheduler, const char* label);
+
+// Starts sending the file at path to the remote peer on a background thread,
+// beginning at offset (rounded down to a chunk boundary) so an interrupted
+// transfer can be resumed. Only one outgoing transfer per peer runs at a time.
+// Returns 0 if the transfer was started, -1 otherwise.
+int Transfer_send(Transfer* pTransfer, const char* path, long long offset);
+
+// Returns true if the datagram is a transfer frame rather than a chat message.
+bool Transfer_isFrame(const char* datagram, int size);
+
+// Handles one transfer frame received from the remote peer. A received file is
+// written to name.part in the working directory and renamed once complete; a
+// file that already has the name is never replaced.
+// Must only be called by one thread at a time.
+void Transfer_receive(Transfer* pTransfer, const char* datagram, int size);
+
+// Stops any outgoing transfer, closes any partially received file and frees
+// pTransfer. The scheduler must have been closed first so the transfer thread
+// can't be blocked on it.
+// Returns 0 on success, or -1 if the transfer thread didn't stop in time; it
+// then still uses pTransfer, the transport and the scheduler, so none of them
+// may be freed.
+int Transfer_destroy(Transfer* pTransfer);
+
+#endif
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ifaddrs.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "spin.h"
+#include "transport.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// socket buffer size requested for both directions
+#define TRANSPORT_SOCKET_BUFLEN (8 * 1024 * 1024)
+
+// microseconds the kernel busy-polls the device for a low-latency receive
+#define TRANSPORT_BUSY_POLL_US 50
+
+static const char* transportNames[] = {"auto", "udp", "unix", "shm"};
+
+int Transport_parseKind(const char* name) {
+    for (int i = 0; i < (int) (sizeof(transportNames) / sizeof(transportNames[0])); i++) {
+        if (!strcmp(name, transportNames[i])) {return i;}
+    }
+    return -1;
+}
+
+const char* Transport_name(Transport* pTransport) {
+    return transportNames[pTransport->kind];
+}
+
+bool Transport_isLocalHost(const char* remoteHostname) {
+    struct addrinfo hints, *servinfo, *p;
+    struct ifaddrs *ifaddr, *ifa;
+    bool local = false;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(remoteHostname, NULL, &hints, &servinfo) != 0) {return false;}
+    if (getifaddrs(&ifaddr) == -1) {ifaddr = NULL;}
+
+    for (p = servinfo; p != NULL && !local; p = p->ai_next) {
+        struct in_addr addr = ((struct sockaddr_in*) p->ai_addr)->sin_addr;
+
+        // all of 127.0.0.0/8 is loopback
+        if ((ntohl(addr.s_addr) >> 24) == 127) {
+            local = true;
+            break;
+        }
+        for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+            if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET) {continue;}
+            if (((struct sockaddr_in*) ifa->ifa_addr)->sin_addr.s_addr == addr.s_addr) {
+                local = true;
+                break;
+            }
+        }
+    }
+
+    if (ifaddr != NULL) {freeifaddrs(ifaddr);}
+    freeaddrinfo(servinfo);
+    return local;
+}
+
+Transport* Transport_open(int kind, const char* myPort, const char* remoteHostname, const char* remotePort) {
+    if (kind == TRANSPORT_AUTO) {
+        if (!Transport_isLocalHost(remoteHostname) || !ShmTransport_canReach(remotePort)) {
+            return UdpTransport_open(myPort, remoteHostname, remotePort);
+        }
+
+        // the peer may not be up yet, or may not be able to open our ring,
+        // so keep UDP open too in case it ends up talking to us there; the
+        // ring goes first so a peer never sees our UDP port without it
+        Transport* pTransport = ShmTransport_open(myPort, remotePort);
+        if (pTransport == NULL) {return NULL;}
+        Transport* pFallback = UdpTransport_open(myPort, remoteHostname, remotePort);
+        if (pFallback == NULL) {
+            Transport_close(pTransport);
+            return NULL;
+        }
+        ShmTransport_setFallback(pTransport, pFallback);
+        return pTransport;
+    }
+
+    switch (kind) {
+        case TRANSPORT_UDP:
+            return UdpTransport_open(myPort, remoteHostname, remotePort);
+        case TRANSPORT_UNIX:
+            return UnixTransport_open(myPort, remotePort);
+        case TRANSPORT_SHM:
+            return ShmTransport_open(myPort, remotePort);
+        default:
+            return NULL;
+    }
+}
+
+int Transport_sendv(Transport* pTransport, const struct iovec* iov, int iovcnt) {
+    return pTransport->ops->sendv(pTransport, iov, iovcnt);
+}
+
+int Transport_send(Transport* pTransport, const void* buffer, int len) {
+    struct iovec iov = {.iov_base = (void*) buffer, .iov_len = len};
+    return pTransport->ops->sendv(pTransport, &iov, 1);
+}
+
+int Transport_recv(Transport* pTransport, char* buffer, int bufferLen, int* pSegmentSize) {
+    return pTransport->ops->recv(pTransport, buffer, bufferLen, pSegmentSize);
+}
+
+void Transport_setLowLatency(Transport* pTransport) {
+    pTransport->ops->setLowLatency(pTransport);
+}
+
+static int setFdNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {return TRANSPORT_FAIL;}
+    return TRANSPORT_SUCCESS;
+}
+
+int Transport_setNonBlocking(Transport* pTransport) {
+    if (pTransport->pollFd == -1) {return TRANSPORT_FAIL;}
+
+    if (setFdNonBlocking(pTransport->pollFd) == TRANSPORT_FAIL ||
+        setFdNonBlocking(pTransport->sendPollFd) == TRANSPORT_FAIL) {
+        return TRANSPORT_FAIL;
+    }
+    return TRANSPORT_SUCCESS;
+}
+
+void Transport_close(Transport* pTransport) {
+    pTransport->ops->close(pTransport);
+    free(pTransport);
+}
+
+// what sendDatagram returns when no one is listening at the other end
+#define SEND_REFUSED 2
+
+// send one datagram on a socket, reporting a non-blocking socket that has no
+// room as TRANSPORT_WOULD_BLOCK and a peer that isn't listening as SEND_REFUSED
+static int sendDatagram(int sockfd, const void* name, socklen_t nameLen, const struct iovec* iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*) name;
+    msg.msg_namelen = nameLen;
+    msg.msg_iov = (struct iovec*) iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (sendmsg(sockfd, &msg, 0) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {return TRANSPORT_WOULD_BLOCK;}
+        if (errno == ECONNREFUSED || errno == ENOENT || errno == ENOTCONN) {return SEND_REFUSED;}
+        if (errno != ENOBUFS && errno != EINTR) {return TRANSPORT_FAIL;}
+        sched_yield();
+    }
+    return TRANSPORT_SUCCESS;
+}
+
+// UDP transport
+
+typedef struct SocketState_s SocketState;
+struct SocketState_s {
+    int sockfdSend;
+    int sockfdRec;
+    struct sockaddr_un remoteAddress;  // Unix transport only
+    socklen_t remoteAddressLen;
+    int connected;                     // Unix transport only: sockfdSend is connected to the peer
+    int lowLatency;
+};
+
+// receive with recvmsg, polling with a bounded backoff in low-latency mode
+static int socketRecvmsg(SocketState* state, struct msghdr* msg) {
+    if (!state->lowLatency) {return recvmsg(state->sockfdRec, msg, 0);}
+
+    SpinBackoff backoff = SPIN_BACKOFF_INIT;
+    while (1) {
+        int size = recvmsg(state->sockfdRec, msg, MSG_DONTWAIT);
+        if (size != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {return size;}
+        pthread_testcancel();
+        Spin_backoff(&backoff);
+    }
+}
+
+static void socketSetLowLatency(Transport* pTransport) {
+    SocketState* state = pTransport->state;
+    state->lowLatency = 1;
+
+    // values above net.core.busy_read need CAP_NET_ADMIN; polling in user
+    // space still works without it
+    int busyPoll = TRANSPORT_BUSY_POLL_US;
+    setsockopt(state->sockfdRec, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll));
+}
+
+static int udpSendv(Transport* pTransport, const struct iovec* iov, int iovcnt) {
+    SocketState* state = pTransport->state;
+    int val = sendDatagram(state->sockfdSend, NULL, 0, iov, iovcnt);
+
+    // like an unconnected UDP socket, drop what the peer refuses
+    return (val == SEND_REFUSED) ? TRANSPORT_SUCCESS : val;
+}
+
+static int udpRecv(Transport* pTransport, char* buffer, int bufferLen, int* pSegmentSize) {
+    SocketState* state = pTransport->state;
+    struct iovec iov = {.iov_base = buffer, .iov_len = bufferLen};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int size = socketRecvmsg(state, &msg);
+    if (size == -1) {return -1;}
+
+    *pSegmentSize = size;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segmentSize;
+            memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+            if (segmentSize > 0) {*pSegmentSize = segmentSize;}
+        }
+    }
+    return size;
+}
+
+static void socketClose(Transport* pTransport) {
+    SocketState* state = pTransport->state;
+    close(state->sockfdSend);
+    close(state->sockfdRec);
+    free(state);
+}
+
+static const TransportOps udpOps = {udpSendv, udpRecv, socketSetLowLatency, socketClose};
+
+Transport* UdpTransport_open(const char* myPort, const char* remoteHostname, const char* remotePort) {
+    // Adapted from Beej's Guide to Network Programming
+    struct addrinfo hints, *servinfo, *p;
+
+    Transport* pTransport = (Transport*) malloc(sizeof(Transport));
+    SocketState* state = (SocketState*) malloc(sizeof(SocketState));
+    if (pTransport == NULL || state == NULL) {
+        free(pTransport);
+        free(state);
+        return NULL;
+    }
+    state->sockfdSend = -1;
+    state->sockfdRec = -1;
+    state->lowLatency = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(remoteHostname, remotePort, &hints, &servinfo) != 0) {goto fail;}
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        state->sockfdSend = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (state->sockfdSend == -1) {continue;}
+
+        // connect so every send goes to the peer without an address
+        if (connect(state->sockfdSend, p->ai_addr, p->ai_addrlen) == -1) {
+            close(state->sockfdSend);
+            state->sockfdSend = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (p == NULL) {goto fail;}
+
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, myPort, &hints, &servinfo) != 0) {goto fail;}
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        state->sockfdRec = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (state->sockfdRec == -1) {continue;}
+
+        if (bind(state->sockfdRec, p->ai_addr, p->ai_addrlen) == -1) {
+            close(state->sockfdRec);
+            state->sockfdRec = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (p == NULL) {goto fail;}
+
+    int bufLen = TRANSPORT_SOCKET_BUFLEN;
+    setsockopt(state->sockfdSend, SOL_SOCKET, SO_SNDBUF, &bufLen, sizeof(bufLen));
+    setsockopt(state->sockfdRec, SOL_SOCKET, SO_RCVBUF, &bufLen, sizeof(bufLen));
+
+    // let the kernel coalesce file transfer datagrams; without GRO the
+    // socket keeps working one datagram at a time
+    int on = 1;
+    setsockopt(state->sockfdRec, SOL_UDP, UDP_GRO, &on, sizeof(on));
+
+    pTransport->ops = &udpOps;
+    pTransport->kind = TRANSPORT_UDP;
+    pTransport->sockfdBatch = state->sockfdSend;
+    pTransport->pollFd = state->sockfdRec;
+    pTransport->sendPollFd = state->sockfdSend;
+    pTransport->state = state;
+    return pTransport;
+
+fail:
+    if (state->sockfdSend != -1) {close(state->sockfdSend);}
+    if (state->sockfdRec != -1) {close(state->sockfdRec);}
+    free(state);
+    free(pTransport);
+    return NULL;
+}
+
+// Unix datagram transport
+
+// each peer binds an abstract socket named after its port, so nothing is left
+// behind in the filesystem
+static socklen_t unixAddress(struct sockaddr_un* address, const char* port) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    int len = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "s-talk-%s", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// sends go through a connected socket, since only then does it poll writable
+// when the peer has room for another datagram. A datagram sent while the peer
+// isn't listening is dropped; a peer that went away since we connected is
+// connected to again in case it came back.
+static int unixSendv(Transport* pTransport, const struct iovec* iov, int iovcnt) {
+    SocketState* state = pTransport->state;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!state->connected) {
+            if (connect(state->sockfdSend, (struct sockaddr*) &state->remoteAddress, state->remoteAddressLen) == -1) {
+                return (errno == ECONNREFUSED || errno == ENOENT) ? TRANSPORT_SUCCESS : TRANSPORT_FAIL;
+            }
+            state->connected = 1;
+        }
+
+        int val = sendDatagram(state->sockfdSend, NULL, 0, iov, iovcnt);
+        if (val != SEND_REFUSED) {return val;}
+
+        // the kernel disconnects a socket whose peer has closed
+        state->connected = 0;
+    }
+    return TRANSPORT_SUCCESS;
+}
+
+static int unixRecv(Transport* pTransport, char* buffer, int bufferLen, int* pSegmentSize) {
+    SocketState* state = pTransport->state;
+    struct iovec iov = {.iov_base = buffer, .iov_len = bufferLen};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    int size = socketRecvmsg(state, &msg);
+    *pSegmentSize = size;
+    return size;
+}
+
+static const TransportOps unixOps = {unixSendv, unixRecv, socketSetLowLatency, socketClose};
+
+Transport* UnixTransport_open(const char* myPort, const char* remotePort) {
+    Transport* pTransport = (Transport*) malloc(sizeof(Transport));
+    SocketState* state = (SocketState*) malloc(sizeof(SocketState));
+    if (pTransport == NULL || state == NULL) {
+        free(pTransport);
+        free(state);
+        return NULL;
+    }
+
+    state->sockfdSend = socket(AF_UNIX, SOCK_DGRAM, 0);
+    state->sockfdRec = socket(AF_UNIX, SOCK_DGRAM, 0);
+    state->connected = 0;
+    state->lowLatency = 0;
+
+    struct sockaddr_un myAddress;
+    socklen_t myAddressLen = unixAddress(&myAddress, myPort);
+    state->remoteAddressLen = unixAddress(&state->remoteAddress, remotePort);
+
+    if (state->sockfdSend == -1 || state->sockfdRec == -1 ||
+        bind(state->sockfdRec, (struct sockaddr*) &myAddress, myAddressLen) == -1) {
+        if (state->sockfdSend != -1) {close(state->sockfdSend);}
+        if (state->sockfdRec != -1) {close(state->sockfdRec);}
+        free(state);
+        free(pTransport);
+        return NULL;
+    }
+
+    int bufLen = TRANSPORT_SOCKET_BUFLEN;
+    setsockopt(state->sockfdSend, SOL_SOCKET, SO_SNDBUF, &bufLen, sizeof(bufLen));
+    setsockopt(state->sockfdRec, SOL_SOCKET, SO_RCVBUF, &bufLen, sizeof(bufLen));
+
+    pTransport->ops = &unixOps;
+    pTransport->kind = TRANSPORT_UNIX;
+    pTransport->sockfdBatch = -1;
+    pTransport->pollFd = state->sockfdRec;
+    pTransport->sendPollFd = state->sockfdSend;
+    pTransport->state = state;
+    return pTransport;
+}
@@ -0,0 +1,117 @@
+// Transport layer under the send and receive loops
+// A transport carries datagrams to the remote peer and delivers datagrams sent
+// to this peer. UDP works between any two hosts; peers on the same host can use
+// a Unix datagram socket or a shared-memory ring instead, skipping the IP stack.
+// Both peers must use the same kind of transport.
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define TRANSPORT_SUCCESS 0
+#define TRANSPORT_FAIL -1
+#define TRANSPORT_WOULD_BLOCK 1  // a non-blocking transport had no room for the datagram
+
+// Largest buffer a single (possibly GRO-coalesced) receive can produce
+#define TRANSPORT_RECV_BUFLEN 65536
+
+// Largest datagram the Unix and shared-memory transports carry
+#define TRANSPORT_MAX_DATAGRAM 2040
+
+enum TransportKind {
+    TRANSPORT_AUTO,  // shared memory if the peer is on this host and can be reached that way, UDP otherwise
+    TRANSPORT_UDP,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM
+};
+
+typedef struct Transport_s Transport;
+
+typedef struct TransportOps_s TransportOps;
+struct TransportOps_s {
+    int (*sendv)(Transport* pTransport, const struct iovec* iov, int iovcnt);
+    int (*recv)(Transport* pTransport, char* buffer, int bufferLen, int* pSegmentSize);
+    void (*setLowLatency)(Transport* pTransport);
+    void (*close)(Transport* pTransport);
+};
+
+struct Transport_s {
+    const TransportOps* ops;
+    int kind;
+    // connected UDP socket that batched (GSO/sendmmsg) sends may use directly,
+    // or -1 for transports that only take one datagram at a time
+    int sockfdBatch;
+    // socket that turns readable when datagrams arrive, or -1 for transports
+    // that can't be waited on with poll/epoll
+    int pollFd;
+    // socket that turns writable once a send that would have blocked can be
+    // retried, or -1 along with pollFd
+    int sendPollFd;
+    void* state;
+};
+
+// Returns the transport kind named by name ("auto", "udp", "unix" or "shm"),
+// or -1 if there is no such kind.
+int Transport_parseKind(const char* name);
+
+// Returns the name of the transport's kind.
+const char* Transport_name(Transport* pTransport);
+
+// Opens a transport of the given kind that receives on myPort and sends to
+// remotePort on remoteHostname. TRANSPORT_AUTO picks UDP when the remote host
+// is another host or the peer has a shared-memory ring we can't open, and
+// shared memory otherwise; that shared-memory transport moves to UDP if the
+// peer turns out to be unreachable over the rings.
+// Returns NULL on failure.
+Transport* Transport_open(int kind, const char* myPort, const char* remoteHostname, const char* remotePort);
+
+// Sends one datagram made of the given buffers to the remote peer. As with UDP,
+// a datagram sent while the peer is not listening is dropped. A shared-memory
+// peer whose ring can't be opened is a failure, not a peer that isn't listening.
+// Returns 0 on success, -1 on failure, or TRANSPORT_WOULD_BLOCK if the transport
+// is non-blocking and the datagram was not sent.
+int Transport_sendv(Transport* pTransport, const struct iovec* iov, int iovcnt);
+
+// Sends one datagram of len bytes to the remote peer.
+// Returns what Transport_sendv does.
+int Transport_send(Transport* pTransport, const void* buffer, int len);
+
+// Blocks until datagrams arrive and copies them into buffer. If several datagrams
+// were coalesced into buffer, *pSegmentSize is set to the size of each of them
+// (the last one may be shorter); otherwise it is set to the returned size.
+// Returns the number of bytes received, or -1 on failure.
+int Transport_recv(Transport* pTransport, char* buffer, int bufferLen, int* pSegmentSize);
+
+// Makes the receiving side poll for datagrams instead of sleeping until one
+// arrives, with SO_BUSY_POLL on sockets so the kernel polls the device too.
+void Transport_setLowLatency(Transport* pTransport);
+
+// Makes Transport_recv return -1 with errno set to EAGAIN instead of blocking
+// when nothing has arrived, and Transport_sendv return TRANSPORT_WOULD_BLOCK
+// instead of blocking while the peer has no room, for callers that wait on
+// pollFd and sendPollFd themselves.
+// Returns 0 on success, -1 if the transport has no pollFd.
+int Transport_setNonBlocking(Transport* pTransport);
+
+// Closes pTransport and releases everything it holds.
+void Transport_close(Transport* pTransport);
+
+// Returns true if remoteHostname resolves to an address of this host.
+bool Transport_isLocalHost(const char* remoteHostname);
+
+// Backends, normally reached through Transport_open
+Transport* UdpTransport_open(const char* myPort, const char* remoteHostname, const char* remotePort);
+Transport* UnixTransport_open(const char* myPort, const char* remotePort);
+Transport* ShmTransport_open(const char* myPort, const char* remotePort);
+
+// Returns false if the peer on remotePort has a shared-memory ring this
+// process can't open, e.g. because another user owns it.
+bool ShmTransport_canReach(const char* remotePort);
+
+// Has a shared-memory transport send over pFallback while the peer's ring
+// can't be opened or isn't there, and use only pFallback once the peer's
+// datagrams arrive there. pTransport takes over pFallback.
+void ShmTransport_setFallback(Transport* pTransport, Transport* pFallback);
+
+#endif
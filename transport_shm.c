@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "spin.h"
+#include "transport.h"
+
+// Shared-memory transport
+// Every peer owns the ring it receives on, a POSIX shared memory object named
+// after its port. Remote peers map it and push datagrams into it. The ring is a
+// bounded multi-producer queue where each slot carries a sequence number
+// telling producers and the consumer whose turn it is. An idle consumer spins
+// briefly, then sleeps on a futex that producers only touch when it is asleep.
+// Picked automatically, the transport also keeps a UDP socket open and moves
+// to it for good when the peer can't be reached through the rings.
+
+// number of slots in a ring (must be a power of two)
+#define SHM_RING_SLOTS 1024
+
+// how many times the consumer polls an empty ring before sleeping; with a
+// single CPU the producer can't run while we spin, so we sleep right away
+#define SHM_SPIN_LIMIT 20000
+
+// how long the consumer sleeps at most, so thread cancellation is noticed
+#define SHM_SLEEP_MS 100
+
+// how long a producer waits on a full ring before checking on its owner
+#define SHM_STALL_MS 1000
+
+// how many backoff rounds a low-latency consumer waits between looks at the
+// UDP fallback
+#define SHM_FALLBACK_POLL_ROUNDS 1024
+
+#define SHM_RING_READY 0x53544b52
+
+typedef struct ShmSlot_s ShmSlot;
+struct ShmSlot_s {
+    _Atomic uint32_t seq;
+    uint32_t len;
+    char data[TRANSPORT_MAX_DATAGRAM];
+};
+
+// producers and the consumer write to different cache lines
+typedef struct ShmRing_s ShmRing;
+struct ShmRing_s {
+    _Atomic uint32_t ready;
+    _Atomic int32_t ownerPid;
+    _Atomic uint32_t sleeping;
+    _Atomic uint32_t wakeups;
+    char pad1[64 - 4 * sizeof(uint32_t)];
+    _Atomic uint32_t tail;  // next slot producers claim
+    char pad2[64 - sizeof(uint32_t)];
+    uint32_t head;          // next slot the consumer reads
+    char pad3[64 - sizeof(uint32_t)];
+    ShmSlot slots[SHM_RING_SLOTS];
+};
+
+typedef struct ShmState_s ShmState;
+struct ShmState_s {
+    ShmRing* in;
+    ShmRing* out;
+    char inName[NAME_MAX];
+    char outName[NAME_MAX];
+    int spinLimit;
+    int lowLatency;  // never sleep on the futex
+    Transport* fallback;      // UDP transport to the same peer, or NULL
+    _Atomic int useFallback;  // the peer is only reachable over fallback
+};
+
+static long futex(_Atomic uint32_t* addr, int op, uint32_t val, const struct timespec* timeout) {
+    return syscall(SYS_futex, (uint32_t*) addr, op, val, timeout, NULL, 0);
+}
+
+static long elapsedMs(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// map the remote peer's ring if it is up, leaving state->out NULL otherwise.
+// Returns -1 with errno set if the ring is there but can't be opened, e.g.
+// because another user owns it.
+static int openOutbound(ShmState* state) {
+    int fd = shm_open(state->outName, O_RDWR, 0);
+    if (fd == -1) {return (errno == ENOENT) ? TRANSPORT_SUCCESS : TRANSPORT_FAIL;}
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return TRANSPORT_FAIL;
+    }
+
+    // the owner may not have sized the ring yet
+    if (st.st_size != sizeof(ShmRing)) {
+        close(fd);
+        return TRANSPORT_SUCCESS;
+    }
+    void* map = mmap(NULL, sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {return TRANSPORT_FAIL;}
+
+    // or may still be initializing the slots
+    ShmRing* ring = map;
+    if (atomic_load_explicit(&ring->ready, memory_order_acquire) != SHM_RING_READY) {
+        munmap(map, sizeof(ShmRing));
+        return TRANSPORT_SUCCESS;
+    }
+    state->out = ring;
+    return TRANSPORT_SUCCESS;
+}
+
+static void closeOutbound(ShmState* state) {
+    munmap(state->out, sizeof(ShmRing));
+    state->out = NULL;
+}
+
+// returns true once the peer is only reachable over the UDP fallback, which
+// is the case as soon as it sends us anything there
+static bool fallbackInUse(ShmState* state) {
+    if (state->fallback == NULL) {return false;}
+    if (atomic_load(&state->useFallback)) {return true;}
+
+    struct pollfd pfd = {.fd = state->fallback->pollFd, .events = POLLIN};
+    if (poll(&pfd, 1, 0) != 1) {return false;}
+    atomic_store(&state->useFallback, 1);
+    return true;
+}
+
+static int shmSendv(Transport* pTransport, const struct iovec* iov, int iovcnt) {
+    ShmState* state = pTransport->state;
+    if (state->fallback != NULL && atomic_load(&state->useFallback)) {
+        return state->fallback->ops->sendv(state->fallback, iov, iovcnt);
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {len += iov[i].iov_len;}
+    if (len > TRANSPORT_MAX_DATAGRAM) {
+        errno = EMSGSIZE;
+        return TRANSPORT_FAIL;
+    }
+
+    // a peer that shut down takes its ring with it; look for a new one
+    if (state->out != NULL && atomic_load_explicit(&state->out->ready, memory_order_acquire) != SHM_RING_READY) {
+        closeOutbound(state);
+    }
+
+    // a ring we can't open is an error unless we can move to UDP
+    if (state->out == NULL && openOutbound(state) == TRANSPORT_FAIL) {
+        if (state->fallback == NULL) {return TRANSPORT_FAIL;}
+        atomic_store(&state->useFallback, 1);
+        return state->fallback->ops->sendv(state->fallback, iov, iovcnt);
+    }
+
+    // like UDP, a datagram sent before the peer is listening is dropped; with
+    // a fallback it goes over UDP in case the peer is only listening there
+    if (state->out == NULL) {
+        if (state->fallback == NULL) {return TRANSPORT_SUCCESS;}
+        return state->fallback->ops->sendv(state->fallback, iov, iovcnt);
+    }
+
+    ShmRing* ring = state->out;
+    ShmSlot* slot;
+    uint32_t pos;
+    struct timespec stallStart = {0, 0};
+
+    // claim a slot
+    while (1) {
+        pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        slot = &ring->slots[pos & (SHM_RING_SLOTS - 1)];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t dif = (int32_t) (seq - pos);
+
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            // ring is full; wait for the consumer unless it has gone away
+            if (stallStart.tv_sec == 0) {clock_gettime(CLOCK_MONOTONIC, &stallStart);}
+            if (elapsedMs(&stallStart) > SHM_STALL_MS) {
+                pid_t owner = atomic_load(&ring->ownerPid);
+                if (kill(owner, 0) == -1 && errno == ESRCH) {
+                    closeOutbound(state);
+                    return TRANSPORT_SUCCESS;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &stallStart);
+            }
+            pthread_testcancel();
+            sched_yield();
+        }
+        else {
+            Spin_relax();
+        }
+    }
+
+    // fill and publish it
+    char* dest = slot->data;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_seq_cst);
+
+    // wake the consumer only if it went to sleep
+    if (atomic_load(&ring->sleeping)) {
+        atomic_fetch_add(&ring->wakeups, 1);
+        futex(&ring->wakeups, FUTEX_WAKE, 1, NULL);
+    }
+    return TRANSPORT_SUCCESS;
+}
+
+static int shmRecv(Transport* pTransport, char* buffer, int bufferLen, int* pSegmentSize) {
+    ShmState* state = pTransport->state;
+    ShmRing* ring = state->in;
+    uint32_t pos = ring->head;
+    ShmSlot* slot = &ring->slots[pos & (SHM_RING_SLOTS - 1)];
+    int spins = 0;
+    int rounds = 0;
+    SpinBackoff backoff = SPIN_BACKOFF_INIT;
+
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+        if (spins < state->spinLimit) {
+            spins++;
+            Spin_relax();
+            continue;
+        }
+
+        // what is left in the ring is delivered before switching over
+        bool checkFallback = !state->lowLatency || ++rounds % SHM_FALLBACK_POLL_ROUNDS == 0;
+        if (checkFallback && fallbackInUse(state)) {
+            return state->fallback->ops->recv(state->fallback, buffer, bufferLen, pSegmentSize);
+        }
+        if (state->lowLatency) {
+            pthread_testcancel();
+            Spin_backoff(&backoff);
+            continue;
+        }
+
+        // announce we're sleeping, then check once more so a datagram
+        // published in between isn't missed
+        uint32_t wakeups = atomic_load(&ring->wakeups);
+        atomic_store(&ring->sleeping, 1);
+        if (atomic_load(&slot->seq) != pos + 1) {
+            struct timespec timeout = {0, SHM_SLEEP_MS * 1000000L};
+            futex(&ring->wakeups, FUTEX_WAIT, wakeups, &timeout);
+        }
+        atomic_store(&ring->sleeping, 0);
+        pthread_testcancel();
+    }
+
+    // the length comes from another process, so never trust it past the slot
+    uint32_t len = slot->len;
+    if (len > TRANSPORT_MAX_DATAGRAM) {len = TRANSPORT_MAX_DATAGRAM;}
+    int size = (len > (uint32_t) bufferLen) ? bufferLen : (int) len;
+    memcpy(buffer, slot->data, size);
+
+    // hand the slot back to producers for the next lap
+    atomic_store_explicit(&slot->seq, pos + SHM_RING_SLOTS, memory_order_release);
+    ring->head = pos + 1;
+
+    *pSegmentSize = size;
+    return size;
+}
+
+static void shmSetLowLatency(Transport* pTransport) {
+    ShmState* state = pTransport->state;
+    state->lowLatency = 1;
+    if (state->fallback != NULL) {Transport_setLowLatency(state->fallback);}
+}
+
+static void shmClose(Transport* pTransport) {
+    ShmState* state = pTransport->state;
+    if (state->out != NULL) {closeOutbound(state);}
+    atomic_store(&state->in->ready, 0);
+    munmap(state->in, sizeof(ShmRing));
+    shm_unlink(state->inName);
+    if (state->fallback != NULL) {Transport_close(state->fallback);}
+    free(state);
+}
+
+// returns true if a ring named name exists and the process that owns it is alive
+static bool ringOwnerAlive(const char* name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {return false;}
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(ShmRing)) {
+        map = mmap(NULL, sizeof(ShmRing), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {return false;}
+
+    // the pid is set before the ring is marked ready, so a ring that is
+    // still being set up counts as in use too
+    pid_t owner = atomic_load(&((ShmRing*) map)->ownerPid);
+    munmap(map, sizeof(ShmRing));
+    return owner > 0 && (kill(owner, 0) == 0 || errno == EPERM);
+}
+
+bool ShmTransport_canReach(const char* remotePort) {
+    char name[NAME_MAX];
+    snprintf(name, sizeof(name), "/s-talk-%s", remotePort);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {return errno == ENOENT;}
+    close(fd);
+    return true;
+}
+
+void ShmTransport_setFallback(Transport* pTransport, Transport* pFallback) {
+    ShmState* state = pTransport->state;
+    state->fallback = pFallback;
+}
+
+static const TransportOps shmOps = {shmSendv, shmRecv, shmSetLowLatency, shmClose};
+
+Transport* ShmTransport_open(const char* myPort, const char* remotePort) {
+    Transport* pTransport = (Transport*) malloc(sizeof(Transport));
+    ShmState* state = (ShmState*) calloc(1, sizeof(ShmState));
+    if (pTransport == NULL || state == NULL) {
+        free(pTransport);
+        free(state);
+        return NULL;
+    }
+    snprintf(state->inName, sizeof(state->inName), "/s-talk-%s", myPort);
+    snprintf(state->outName, sizeof(state->outName), "/s-talk-%s", remotePort);
+
+    // replace a ring left behind by an earlier run on this port, but fail
+    // like a bound socket would if its owner is still running
+    if (ringOwnerAlive(state->inName)) {
+        errno = EADDRINUSE;
+        free(state);
+        free(pTransport);
+        return NULL;
+    }
+    shm_unlink(state->inName);
+    int fd = shm_open(state->inName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    void* map = MAP_FAILED;
+    if (fd != -1) {
+        if (ftruncate(fd, sizeof(ShmRing)) == 0) {
+            map = mmap(NULL, sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        if (fd != -1) {shm_unlink(state->inName);}
+        free(state);
+        free(pTransport);
+        return NULL;
+    }
+
+    ShmRing* ring = map;
+    for (uint32_t i = 0; i < SHM_RING_SLOTS; i++) {
+        atomic_init(&ring->slots[i].seq, i);
+    }
+    ring->head = 0;
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleeping, 0);
+    atomic_init(&ring->wakeups, 0);
+    atomic_init(&ring->ownerPid, getpid());
+    atomic_store_explicit(&ring->ready, SHM_RING_READY, memory_order_release);
+
+    state->in = ring;
+    state->out = NULL;
+    state->spinLimit = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN_LIMIT : 0;
+
+    pTransport->ops = &shmOps;
+    pTransport->kind = TRANSPORT_SHM;
+    pTransport->sockfdBatch = -1;
+    pTransport->pollFd = -1;
+    pTransport->sendPollFd = -1;
+    pTransport->state = state;
+    return pTransport;
+}